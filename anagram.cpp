@@ -20,115 +20,4206 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iterator>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <boost/program_options.hpp>
 
-namespace po = boost::program_options;
-const size_t ALPHABET_LEN = 26;
+namespace po = boost::program_options;
+
+// whether to collect the statistics printed by --stats that the search doesn't
+// need itself. Building with ANAGRAM_NO_STATS compiles them out
+#ifdef ANAGRAM_NO_STATS
+const bool collect_stats = false;
+#else
+const bool collect_stats = true;
+#endif
+
+// heap allocations made by the whole program, counted to check that the
+// search doesn't allocate once it's warmed up. Counting replaces the global
+// operator new, so it's only built with ANAGRAM_COUNT_ALLOCATIONS
+std::atomic<std::uint64_t> allocation_count{0};
+
+#ifdef ANAGRAM_COUNT_ALLOCATIONS
+const bool count_allocations = true;
+
+// neither is inlined, or GCC mistakes the malloc and free inside for a
+// mismatch with new and delete
+__attribute__((noinline)) void * operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if(auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept
+{
+    std::free(p);
+}
+#else
+const bool count_allocations = false;
+#endif
+
+const size_t ALPHABET_LEN = 26;
+
+// Count of each letter, packed one byte per letter, in Slots slots: the most
+// letters an alphabet can have, a multiple of the vector register width. 32
+// holds the English alphabet in one AVX2 register, and 64 the larger ones of
+// --unicode. Slots is a constant, so every loop over it is fully unrolled
+template<std::size_t Slots>
+struct alignas(16) Basic_letter_counts
+{
+    static_assert(Slots % 32 == 0, "Slots must be a multiple of the AVX2 register width");
+
+    static const std::size_t slots = Slots;
+
+    // a bit for each slot
+    typedef typename std::conditional<Slots <= 32, std::uint32_t, std::uint64_t>::type Mask;
+
+    std::array<std::uint8_t, Slots> counts;
+
+    std::uint8_t & operator[](const std::size_t i) { return counts[i]; }
+    std::uint8_t operator[](const std::size_t i) const { return counts[i]; }
+
+    bool operator==(const Basic_letter_counts & other) const { return counts == other.counts; }
+
+    // bitmask of the letters with a non-zero count
+    Mask mask() const
+    {
+        Mask zeros = 0;
+#if defined(__AVX2__)
+        for(std::size_t i = 0; i < Slots; i += 32)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts.data() + i));
+            zeros |= Mask(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_setzero_si256())))) << i;
+        }
+#elif defined(__SSE2__)
+        for(std::size_t i = 0; i < Slots; i += 16)
+        {
+            auto a = _mm_load_si128(reinterpret_cast<const __m128i *>(counts.data() + i));
+            zeros |= Mask(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())))) << i;
+        }
+#else
+        for(std::size_t i = 0; i < Slots; ++i)
+        {
+            if(!counts[i])
+                zeros |= Mask(1) << i;
+        }
+#endif
+        return ~zeros;
+    }
+
+    bool empty() const
+    {
+#if defined(__AVX2__)
+        auto a = _mm256_setzero_si256();
+        for(std::size_t i = 0; i < Slots; i += 32)
+            a = _mm256_or_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts.data() + i)));
+        return _mm256_testz_si256(a, a);
+#elif defined(__SSE2__)
+        auto a = _mm_setzero_si128();
+        for(std::size_t i = 0; i < Slots; i += 16)
+            a = _mm_or_si128(a, _mm_load_si128(reinterpret_cast<const __m128i *>(counts.data() + i)));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xFFFF;
+#else
+        return std::all_of(counts.begin(), counts.end(), [](std::uint8_t i){ return i == 0; });
+#endif
+    }
+
+    // number of letters
+    std::size_t total() const
+    {
+#if defined(__SSE2__)
+        // sums of each 8 bytes, in the low bits of each 64-bit half
+        auto sums = _mm_setzero_si128();
+        for(std::size_t i = 0; i < Slots; i += 16)
+        {
+            auto a = _mm_load_si128(reinterpret_cast<const __m128i *>(counts.data() + i));
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(a, _mm_setzero_si128()));
+        }
+        return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+#else
+        return std::accumulate(counts.begin(), counts.end(), std::size_t(0));
+#endif
+    }
+
+    // true if word fits in these letters
+    bool contains(const Basic_letter_counts & word) const
+    {
+#if defined(__AVX2__)
+        // any lane where word has more of a letter than is left will be non-zero
+        auto over = _mm256_setzero_si256();
+        for(std::size_t i = 0; i < Slots; i += 32)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts.data() + i));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(word.counts.data() + i));
+            over = _mm256_or_si256(over, _mm256_subs_epu8(b, a));
+        }
+        return _mm256_testz_si256(over, over);
+#elif defined(__SSE2__)
+        // any lane where word has more of a letter than is left will be non-zero
+        auto over = _mm_setzero_si128();
+        for(std::size_t i = 0; i < Slots; i += 16)
+        {
+            auto a = _mm_load_si128(reinterpret_cast<const __m128i *>(counts.data() + i));
+            auto b = _mm_load_si128(reinterpret_cast<const __m128i *>(word.counts.data() + i));
+            over = _mm_or_si128(over, _mm_subs_epu8(b, a));
+        }
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) == 0xFFFF;
+#else
+        for(std::size_t i = 0; i < Slots; ++i)
+        {
+            if(word.counts[i] > counts[i])
+                return false;
+        }
+        return true;
+#endif
+    }
+
+    // store these letters minus word's in remaining. word must fit
+    void subtract_unchecked(const Basic_letter_counts & word, Basic_letter_counts & remaining) const
+    {
+#if defined(__AVX2__)
+        for(std::size_t i = 0; i < Slots; i += 32)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts.data() + i));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(word.counts.data() + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(remaining.counts.data() + i), _mm256_sub_epi8(a, b));
+        }
+#elif defined(__SSE2__)
+        for(std::size_t i = 0; i < Slots; i += 16)
+        {
+            auto a = _mm_load_si128(reinterpret_cast<const __m128i *>(counts.data() + i));
+            auto b = _mm_load_si128(reinterpret_cast<const __m128i *>(word.counts.data() + i));
+            _mm_store_si128(reinterpret_cast<__m128i *>(remaining.counts.data() + i), _mm_sub_epi8(a, b));
+        }
+#else
+        for(std::size_t i = 0; i < Slots; ++i)
+            remaining.counts[i] = counts[i] - word.counts[i];
+#endif
+    }
+
+    // if word fits in these letters, store the letters left over in remaining
+    // and return true. Otherwise return false
+    bool subtract(const Basic_letter_counts & word, Basic_letter_counts & remaining) const
+    {
+        if(!contains(word))
+            return false;
+        subtract_unchecked(word, remaining);
+        return true;
+    }
+};
+
+typedef Basic_letter_counts<32> Letter_counts;
+typedef Basic_letter_counts<64> Wide_letter_counts;
+
+struct Letter_counts_hash
+{
+    template<std::size_t Slots>
+    std::size_t operator()(const Basic_letter_counts<Slots> & ltrs, const std::uint64_t seed = 0) const
+    {
+        std::uint64_t words[Slots / 8];
+        std::memcpy(words, ltrs.counts.data(), sizeof(words));
+        std::uint64_t hash = seed;
+        for(auto w: words)
+            hash = (hash ^ w) * 0x9e3779b97f4a7c15;
+        return hash ^ (hash >> 32);
+    }
+};
+
+// The code point at text[i], moving i past it, or invalid_code_point if it
+// isn't valid UTF-8
+const char32_t invalid_code_point = 0xFFFFFFFF;
+
+char32_t decode_utf8(const char * text, const std::size_t size, std::size_t & i)
+{
+    const auto lead = static_cast<unsigned char>(text[i++]);
+    if(lead < 0x80)
+        return lead;
+
+    std::size_t length;
+    char32_t c;
+    if((lead & 0xE0) == 0xC0)
+    {
+        length = 1;
+        c = lead & 0x1F;
+    }
+    else if((lead & 0xF0) == 0xE0)
+    {
+        length = 2;
+        c = lead & 0x0F;
+    }
+    else if((lead & 0xF8) == 0xF0)
+    {
+        length = 3;
+        c = lead & 0x07;
+    }
+    else
+        return invalid_code_point;
+
+    for(std::size_t j = 0; j < length; ++j, ++i)
+    {
+        if(i == size || (static_cast<unsigned char>(text[i]) & 0xC0) != 0x80)
+            return invalid_code_point;
+        c = c << 6 | (text[i] & 0x3F);
+    }
+
+    // reject overlong encodings, surrogates and anything past the last code point
+    static const char32_t min_code_point[] = {0, 0x80, 0x800, 0x10000};
+    if(c < min_code_point[length] || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+        return invalid_code_point;
+    return c;
+}
+
+void append_utf8(const char32_t c, std::string & text)
+{
+    if(c < 0x80)
+        text += static_cast<char>(c);
+    else if(c < 0x800)
+    {
+        text += static_cast<char>(0xC0 | c >> 6);
+        text += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if(c < 0x10000)
+    {
+        text += static_cast<char>(0xE0 | c >> 12);
+        text += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+        text += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        text += static_cast<char>(0xF0 | c >> 18);
+        text += static_cast<char>(0x80 | (c >> 12 & 0x3F));
+        text += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+        text += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+// The upper case form of c, for the Latin, Greek and Cyrillic letters. Other
+// letters are left as they are, as are those whose upper case form takes a
+// different number of bytes in UTF-8, so text can be upper-cased in place
+char32_t upper_case(const char32_t c)
+{
+    if(c >= 'a' && c <= 'z')
+        return c - 0x20;
+    if(c < 0x80)
+        return c;
+
+    // Latin-1 Supplement
+    if(c >= 0xE0 && c <= 0xFE && c != 0xF7)
+        return c - 0x20;
+    if(c == 0xFF)
+        return 0x178;
+
+    // Latin Extended-A, mostly pairs of upper then lower case
+    if((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+        return c & ~char32_t(1);
+    if((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+        return c % 2 ? c : c - 1;
+
+    // Greek
+    if(c == 0x3C2) // final sigma
+        return 0x3A3;
+    if((c >= 0x3B1 && c <= 0x3C1) || (c >= 0x3C3 && c <= 0x3CB))
+        return c - 0x20;
+    if(c == 0x3AC)
+        return 0x386;
+    if(c >= 0x3AD && c <= 0x3AF)
+        return c - 0x25;
+    if(c == 0x3CC)
+        return 0x38C;
+    if(c == 0x3CD || c == 0x3CE)
+        return c - 0x3F;
+
+    // Cyrillic
+    if(c >= 0x430 && c <= 0x44F)
+        return c - 0x20;
+    if(c >= 0x450 && c <= 0x45F)
+        return c - 0x50;
+
+    return c;
+}
+
+// word upper-cased as a dictionary's words are, or as it is if it isn't UTF-8
+std::string upper_case_word(const std::string & word)
+{
+    std::string upper;
+    for(std::size_t i = 0; i < word.size();)
+    {
+        const auto c = decode_utf8(word.data(), word.size(), i);
+        if(c == invalid_code_point)
+            return word;
+        append_utf8(upper_case(c), upper);
+    }
+    return upper;
+}
+
+bool is_apostrophe(const char32_t c)
+{
+    return c == '\'' || c == 0x2019; // right single quotation mark
+}
+
+// Whether c can be a letter of a --unicode alphabet: an upper case ASCII
+// letter, or a letter of the Latin, Greek, Cyrillic, Armenian, Hebrew, Arabic,
+// kana, Hangul or CJK blocks. Symbols, digits and combining marks aren't, so
+// words with them are skipped, as they are without --unicode
+bool is_letter(const char32_t c)
+{
+    if(c < 0x80)
+        return c >= 'A' && c <= 'Z';
+    return (c >= 0xC0 && c <= 0x24F && c != 0xD7 && c != 0xF7) // Latin-1 letters, Latin Extended-A and B
+        || (c >= 0x1E00 && c <= 0x1EFF) // Latin Extended Additional
+        || c == 0x386 || (c >= 0x388 && c <= 0x3CE && c != 0x38B && c != 0x38D && c != 0x3A2) // Greek
+        || (c >= 0x400 && c <= 0x481) || (c >= 0x48A && c <= 0x52F) // Cyrillic
+        || (c >= 0x531 && c <= 0x556) || (c >= 0x561 && c <= 0x587) // Armenian
+        || (c >= 0x5D0 && c <= 0x5EA) // Hebrew
+        || (c >= 0x620 && c <= 0x64A) || (c >= 0x671 && c <= 0x6D3) // Arabic
+        || (c >= 0x3041 && c <= 0x3096) || (c >= 0x30A1 && c <= 0x30FA) // Hiragana and Katakana
+        || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0x4E00 && c <= 0x9FFF) // CJK Unified Ideographs
+        || (c >= 0xAC00 && c <= 0xD7A3); // Hangul Syllables
+}
+
+// Each letter is assigned a prime, the smallest going to the most common
+// letters in English. The product of a word's letters' primes divides the
+// product of another's only if the word fits in the other's letters
+const std::array<std::uint64_t, ALPHABET_LEN> letter_primes
+{
+//   A  B   C   D   E   F   G   H   I   J   K   L   M
+     5, 71, 41, 29, 2,  53, 59, 23, 11, 89, 79, 31, 43,
+//   N   O  P   Q    R   S   T  U   V   W   X   Y   Z
+     17, 7, 67, 101, 19, 13, 3, 37, 73, 47, 83, 61, 97
+};
+
+// The primes for --unicode alphabets, in order, as their letters are sorted
+// most common first
+const std::array<std::uint64_t, 64> slot_primes
+{
+      2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+     59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+// The letters words are made of, each with its slot in Letter_counts. By
+// default, the English alphabet, A to Z. With --unicode, words are UTF-8, and
+// the alphabet is every letter in the dictionary, most common first
+class Alphabet
+{
+public:
+    Alphabet() = default;
+
+    // a --unicode alphabet. letters are upper case, and each is given the slot
+    // of its position
+    explicit Alphabet(std::vector<char32_t> letters): unicode_(true), letters_(std::move(letters))
+    {
+        for(std::size_t i = 0; i < letters_.size(); ++i)
+            slots_.emplace(letters_[i], static_cast<int>(i));
+    }
+
+    bool english() const { return !unicode_; }
+
+    std::size_t size() const { return english() ? ALPHABET_LEN : letters_.size(); }
+
+    // the letters in slot order, or empty for English
+    const std::vector<char32_t> & letters() const { return letters_; }
+
+    // slot of the upper case letter c, or -1 if it's not in the alphabet
+    int slot(const char32_t c) const
+    {
+        if(english())
+            return c >= 'A' && c <= 'Z' ? static_cast<int>(c - 'A') : -1;
+        auto found = slots_.find(c);
+        return found == slots_.end() ? -1 : found->second;
+    }
+
+    // the prime of each slot, for letter_product
+    const std::uint64_t * primes() const { return english() ? letter_primes.data() : slot_primes.data(); }
+
+private:
+    bool unicode_ = false;
+    std::vector<char32_t> letters_;
+    std::unordered_map<char32_t, int> slots_;
+};
+
+// count the letters of word, which is upper case, skipping apostrophes.
+// Returns false if there are too many of any one letter to fit in a
+// Letter_counts, or a letter that isn't in the alphabet
+template<class Counts>
+bool count_letters(const char * word, const std::size_t size, const Alphabet & alphabet, Counts & ltrs)
+{
+    ltrs = Counts{};
+    if(alphabet.english())
+    {
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            const auto c = word[i];
+            if(c == '\'')
+                continue;
+
+            if(ltrs[c - 'A'] == std::numeric_limits<std::uint8_t>::max())
+                return false;
+
+            ++ltrs[c - 'A'];
+        }
+        return true;
+    }
+
+    for(std::size_t i = 0; i < size;)
+    {
+        const auto c = decode_utf8(word, size, i);
+        if(is_apostrophe(c))
+            continue;
+
+        const auto slot = alphabet.slot(c);
+        if(slot < 0 || ltrs[slot] == std::numeric_limits<std::uint8_t>::max())
+            return false;
+
+        ++ltrs[slot];
+    }
+    return true;
+}
+
+// product of the letters' primes, or 0 if it would overflow
+template<class Counts>
+std::uint64_t letter_product(const Counts & ltrs, const Alphabet & alphabet)
+{
+    const auto primes = alphabet.primes();
+    std::uint64_t product = 1;
+    for(std::size_t i = 0; i < alphabet.size(); ++i)
+    {
+        for(std::uint8_t j = 0; j < ltrs[i]; ++j)
+        {
+            if(__builtin_mul_overflow(product, primes[i], &product))
+                return 0;
+        }
+    }
+    return product;
+}
+
+// dictionary options that change which words are loaded
+enum Dictionary_flags: std::uint32_t { NO_APOSTROPHE = 1, SMALL_WORDS = 2, UNICODE_ALPHABET = 4 };
+
+// a word, as where it is in a block of text
+struct Text_span
+{
+    std::uint32_t offset;
+    std::uint32_t size;
+};
+
+// Header of a Word_list's storage block, and so of an index file
+struct Index_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t letter_counts_size;
+    std::uint32_t flags; // Dictionary_flags
+    std::uint64_t num_classes;
+    std::uint64_t num_words;
+    std::uint64_t num_trie_nodes; // 0 if it has no Letter_trie
+    std::uint64_t text_size;
+    std::uint64_t source_path_size;
+    std::uint64_t alphabet_size; // letters of a --unicode alphabet, or 0 for English
+    // size and modification time of the dictionary file the index was built from
+    std::uint64_t source_size;
+    std::int64_t source_mtime;
+    std::uint64_t checksum; // of everything after the header
+};
+
+const char index_magic[8] = {'A', 'N', 'A', 'G', 'R', 'A', 'M', '\0'};
+const std::uint32_t index_version = 4;
+const std::uint32_t index_byte_order = 0x01020304;
+
+// round up to a multiple of 16, so that each array in the block stays aligned
+constexpr std::size_t align_16(const std::size_t size)
+{
+    return (size + 15) & ~std::size_t(15);
+}
+
+// 64-bit FNV-1a, taken 8 bytes at a time
+std::uint64_t checksum(const char * data, const std::size_t size)
+{
+    std::uint64_t hash = 0xcbf29ce484222325;
+    std::size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        std::uint64_t chunk;
+        std::memcpy(&chunk, data + i, sizeof(chunk));
+        hash = (hash ^ chunk) * 0x100000001b3;
+    }
+    for(; i < size; ++i)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+    return hash;
+}
+
+// Which of a dictionary's words a search may use, for --min-word-len,
+// --max-word-len and --exclude-file. Lengths are in letters
+struct Word_filter
+{
+    std::size_t min_letters = 0;
+    std::size_t max_letters = 0; // 0 for no limit
+    std::shared_ptr<const std::vector<bool>> excluded; // by word index in the dictionary, if set
+
+    bool keeps_length(const std::size_t letters) const
+    {
+        return letters >= min_letters && (!max_letters || letters <= max_letters);
+    }
+    bool excludes(const std::size_t w) const { return excluded && (*excluded)[w]; }
+};
+
+// A trie of the letters of classes of words, each class spelled out one
+// letter per edge, in slot order, and ending at its own node. Nodes are
+// numbered breadth first, so each node's children are numbered consecutively,
+// and follow the previous node's
+template<class Counts>
+struct Letter_trie
+{
+    static const std::uint32_t no_class = std::numeric_limits<std::uint32_t>::max();
+
+    std::vector<std::uint32_t> children; // node i's children are [children[i], children[i + 1])
+    std::vector<std::uint32_t> classes; // class ending at each node, or no_class
+    // letters that every class below each node still needs, after the letters
+    // on the path to it. A node can be skipped when any of them have run out
+    std::vector<typename Counts::Mask> needs;
+    std::vector<std::uint8_t> slots; // the letter on the edge to each node
+};
+
+template<class Counts>
+const std::uint32_t Letter_trie<Counts>::no_class;
+
+// Build a Letter_trie of the classes of words with letters class_ltrs(0) to
+// class_ltrs(num_classes - 1)
+template<class Counts, class Class_ltrs>
+Letter_trie<Counts> build_trie(const std::size_t num_classes, Class_ltrs class_ltrs)
+{
+    typedef typename Counts::Mask Mask;
+
+    // spell out each class's letters, and sort the classes by their spellings.
+    // Most are told apart by their first 8 letters, packed into a key, so the
+    // spellings themselves are rarely compared
+    std::vector<std::uint32_t> offsets(num_classes + 1);
+    for(std::size_t c = 0; c < num_classes; ++c)
+        offsets[c + 1] = offsets[c] + class_ltrs(c).total();
+
+    std::vector<std::uint8_t> spellings(offsets[num_classes]);
+    struct Sort_key
+    {
+        std::uint64_t prefix; // slot + 1 of each of the first 8 letters, then 0s
+        std::uint32_t c;
+    };
+    std::vector<Sort_key> keys(num_classes);
+    for(std::size_t c = 0; c < num_classes; ++c)
+    {
+        const Counts & ltrs = class_ltrs(c);
+        auto pos = spellings.data() + offsets[c];
+        for(auto mask = ltrs.mask(); mask; mask &= mask - 1)
+        {
+            const auto slot = __builtin_ctzll(mask);
+            pos = std::fill_n(pos, ltrs[slot], static_cast<std::uint8_t>(slot));
+        }
+
+        std::uint64_t prefix = 0;
+        for(std::size_t i = 0; i < 8; ++i)
+            prefix = prefix << 8 | (offsets[c] + i < offsets[c + 1] ? spellings[offsets[c] + i] + 1 : 0);
+        keys[c] = Sort_key{prefix, static_cast<std::uint32_t>(c)};
+    }
+
+    std::sort(keys.begin(), keys.end(), [&](const Sort_key & a, const Sort_key & b)
+    {
+        if(a.prefix != b.prefix)
+            return a.prefix < b.prefix;
+
+        // equal prefixes are either the whole of both spellings, or the start
+        const auto a_size = offsets[a.c + 1] - offsets[a.c], b_size = offsets[b.c + 1] - offsets[b.c];
+        if(a_size <= 8 || b_size <= 8)
+            return a_size < b_size;
+        auto cmp = std::memcmp(&spellings[offsets[a.c] + 8], &spellings[offsets[b.c] + 8], std::min(a_size, b_size) - 8);
+        return cmp < 0 || (cmp == 0 && a_size < b_size);
+    });
+
+    // lay the spellings out in sorted order, so each level of the trie reads
+    // them in order
+    std::vector<std::uint8_t> sorted(spellings.size());
+    std::vector<std::uint32_t> sorted_offsets(num_classes + 1);
+    for(std::size_t i = 0; i < num_classes; ++i)
+    {
+        const auto c = keys[i].c;
+        std::copy(&spellings[offsets[c]], &spellings[offsets[c + 1]], &sorted[sorted_offsets[i]]);
+        sorted_offsets[i + 1] = sorted_offsets[i] + (offsets[c + 1] - offsets[c]);
+    }
+    std::vector<std::uint8_t>().swap(spellings);
+
+    // each node stands for the range of sorted spellings that start with the
+    // path to it. A class ending at the node sorts first in its range
+    struct Node_range
+    {
+        std::uint32_t begin, end, depth;
+    };
+    std::vector<Node_range> ranges{Node_range{0, static_cast<std::uint32_t>(num_classes), 0}};
+
+    Letter_trie<Counts> trie;
+    trie.slots.push_back(0);
+    for(std::size_t n = 0; n < ranges.size(); ++n)
+    {
+        auto range = ranges[n];
+        trie.children.push_back(ranges.size());
+
+        if(range.begin < range.end && sorted_offsets[range.begin + 1] - sorted_offsets[range.begin] == range.depth)
+            trie.classes.push_back(keys[range.begin++].c);
+        else
+            trie.classes.push_back(Letter_trie<Counts>::no_class);
+
+        for(auto i = range.begin; i < range.end;)
+        {
+            const auto slot = sorted[sorted_offsets[i] + range.depth];
+            auto j = i + 1;
+            while(j < range.end && sorted[sorted_offsets[j] + range.depth] == slot)
+                ++j;
+            ranges.push_back(Node_range{i, j, range.depth + 1});
+            trie.slots.push_back(slot);
+            i = j;
+        }
+    }
+    trie.children.push_back(ranges.size());
+
+    // children are numbered after their parents, so work up from the last
+    trie.needs.resize(ranges.size());
+    for(std::size_t n = ranges.size(); n-- > 0;)
+    {
+        Mask needs = trie.classes[n] == Letter_trie<Counts>::no_class ? ~Mask(0) : 0;
+        for(auto child = trie.children[n]; child < trie.children[n + 1]; ++child)
+            needs &= (Mask(1) << trie.slots[child]) | trie.needs[child];
+        trie.needs[n] = needs;
+    }
+
+    return trie;
+}
+
+// The dictionary. Words with the same letters are grouped into classes (eg.
+// STOP, POTS, TOPS, SPOT, OPTS), which are what's actually searched. Each class
+// has its letter counts, and the bitmask and prime product of its letters (see
+// letter_product) for quickly rejecting it. Everything is stored in one
+// contiguous block:
+//
+//     Index_header
+//     uint32_t      alphabet[alphabet_size]            (code points, by slot)
+//     Counts        ltrs[num_classes]
+//     uint64_t      products[num_classes]
+//     Counts::Mask  masks[num_classes]
+//     uint32_t      class_offsets[num_classes + 1]     (start of each class in members)
+//     uint32_t      members[num_words]                 (word indices, by class)
+//     uint32_t      word_offsets[num_words + 1]        (start of each word in text)
+//     char          text[text_size]                    (the words, back to back)
+//     uint32_t      trie_children[num_trie_nodes + 1]  (see Letter_trie)
+//     uint32_t      trie_classes[num_trie_nodes]
+//     Counts::Mask  trie_needs[num_trie_nodes]
+//     uint8_t       trie_slots[num_trie_nodes]
+//     char          source_path[source_path_size]
+//
+// with each array aligned to 16 bytes. Words are sorted, and classes are
+// sorted by their first word. The block is the same in memory as in an index
+// file, so an index is used straight from mmap, without copying. Counts is
+// the Basic_letter_counts big enough for the alphabet
+template<class Counts>
+class Word_list
+{
+public:
+    typedef typename Counts::Mask Mask;
+
+    Word_list() = default;
+
+    // words are spans of text, and must be sorted and unique, and ltrs their
+    // letter counts in alphabet. flags and source_path record how they were
+    // read. with_trie builds a Letter_trie for prune, which takes longer than
+    // a single prune without it
+    Word_list(const char * text,
+              const std::vector<Text_span> & words,
+              const std::vector<Counts> & ltrs,
+              const Alphabet & alphabet,
+              const std::uint32_t flags,
+              const std::string & source_path,
+              const bool with_trie);
+
+    // map an index file written by write_index. Throws std::runtime_error if
+    // it can't be read, is corrupt, or is older than its source dictionary
+    static Word_list map_index(const std::string & path);
+
+    // Throws std::runtime_error on failure
+    void write_index(const std::string & path) const;
+
+    // make this a view of only the classes of dictionary whose words fit in
+    // ltrs, numbered in the same order, for a search of ltrs to use in place
+    // of dictionary. Its arrays hold nothing else, so the search's nodes test
+    // fewer classes and touch less memory. The classes are found by walking
+    // dictionary's trie if it has one, or by testing each of them if not.
+    // Words that filter excludes are left out too, as are classes left with
+    // none. Reuses this list's memory when it's big enough
+    void prune(const Word_list & dictionary, const Counts & ltrs, const Word_filter & filter = Word_filter());
+
+    std::uint32_t flags() const { return header().flags; }
+    const Alphabet & alphabet() const { return alphabet_; }
+
+    std::size_t num_words() const { return num_words_; }
+    const char * word(const std::size_t i) const { return text_ + word_offsets_[i]; }
+    std::size_t word_size(const std::size_t i) const { return word_offsets_[i + 1] - word_offsets_[i]; }
+
+    std::size_t num_classes() const { return num_classes_; }
+    const Counts & ltrs(const std::size_t c) const { return ltrs_[c]; }
+    std::uint64_t product(const std::size_t c) const { return products_[c]; }
+    Mask mask(const std::size_t c) const { return masks_[c]; }
+    std::size_t class_size(const std::size_t c) const { return class_offsets_[c + 1] - class_offsets_[c]; }
+    // word index of the j-th word in class c
+    std::uint32_t class_word(const std::size_t c, const std::size_t j) const { return members_[class_offsets_[c] + j]; }
+
+    // index of the word with this text, or num_words() if there isn't one
+    std::size_t find_word(const std::string & text) const
+    {
+        std::size_t lo = 0, hi = num_words_;
+        while(lo < hi)
+        {
+            const auto mid = lo + (hi - lo) / 2;
+            const auto size = word_size(mid);
+            auto cmp = std::memcmp(word(mid), text.data(), std::min(size, text.size()));
+            if(cmp < 0 || (cmp == 0 && size < text.size()))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo < num_words_ && word_size(lo) == text.size() && std::memcmp(word(lo), text.data(), text.size()) == 0
+            ? lo : num_words_;
+    }
+
+    // a hash of the words, in order, for telling whether two lists are the same
+    std::uint64_t words_checksum() const
+    {
+        return checksum(text_, word_offsets_[num_words_]) * 0x100000001b3
+            ^ checksum(reinterpret_cast<const char *>(word_offsets_), (num_words_ + 1) * sizeof(std::uint32_t));
+    }
+
+private:
+    const Index_header & header() const { return *reinterpret_cast<const Index_header *>(block_.get()); }
+
+    // size of the block needed for a header with these sizes
+    static std::size_t block_size(const Index_header & header)
+    {
+        return align_16(sizeof(Index_header))
+            + align_16(header.alphabet_size * sizeof(std::uint32_t))
+            + align_16(header.num_classes * sizeof(Counts))
+            + align_16(header.num_classes * sizeof(std::uint64_t))
+            + align_16(header.num_classes * sizeof(Mask))
+            + align_16((header.num_classes + 1) * sizeof(std::uint32_t))
+            + align_16(header.num_words * sizeof(std::uint32_t))
+            + align_16((header.num_words + 1) * sizeof(std::uint32_t))
+            + align_16(header.text_size)
+            + align_16((header.num_trie_nodes + 1) * sizeof(std::uint32_t))
+            + align_16(header.num_trie_nodes * sizeof(std::uint32_t))
+            + align_16(header.num_trie_nodes * sizeof(Mask))
+            + align_16(header.num_trie_nodes * sizeof(std::uint8_t))
+            + header.source_path_size;
+    }
+
+    // point the arrays into block_
+    void set_arrays();
+
+    std::shared_ptr<const char> block_; // heap allocated, or mmapped
+    std::size_t block_size_ = 0;
+    std::size_t block_capacity_ = 0; // of a block allocated by prune, which can be reused
+
+    std::size_t num_classes_ = 0;
+    std::size_t num_words_ = 0;
+    Alphabet alphabet_;
+    const std::uint32_t * alphabet_letters_ = nullptr;
+    const Counts * ltrs_ = nullptr;
+    const std::uint64_t * products_ = nullptr;
+    const Mask * masks_ = nullptr;
+    const std::uint32_t * class_offsets_ = nullptr;
+    const std::uint32_t * members_ = nullptr;
+    const std::uint32_t * word_offsets_ = nullptr;
+    const char * text_ = nullptr;
+    // see Letter_trie
+    std::size_t num_trie_nodes_ = 0;
+    const std::uint32_t * trie_children_ = nullptr;
+    const std::uint32_t * trie_classes_ = nullptr;
+    const Mask * trie_needs_ = nullptr;
+    const std::uint8_t * trie_slots_ = nullptr;
+    const char * source_path_ = nullptr;
+
+    // scratch space for prune: the dictionary's classes and words kept, and
+    // the trie nodes left to visit, with the letters left at each
+    struct Trie_visit
+    {
+        std::uint32_t node;
+        Mask mask;
+        Counts ltrs;
+    };
+    std::vector<std::uint32_t> kept_classes_;
+    std::vector<std::uint32_t> kept_words_;
+    std::vector<Trie_visit> trie_stack_;
+};
+
+template<class Counts>
+Word_list<Counts>::Word_list(const char * text,
+                             const std::vector<Text_span> & words,
+                             const std::vector<Counts> & ltrs,
+                             const Alphabet & alphabet,
+                             const std::uint32_t flags,
+                             const std::string & source_path,
+                             const bool with_trie)
+{
+    // group words into classes, numbered in order of their first word
+    std::vector<std::uint32_t> word_classes(words.size());
+    std::vector<std::uint32_t> class_sizes;
+    std::vector<std::uint32_t> first_words;
+    {
+        std::unordered_map<Counts, std::uint32_t, Letter_counts_hash> classes(words.size());
+        for(std::size_t i = 0; i < words.size(); ++i)
+        {
+            auto c = classes.emplace(ltrs[i], class_sizes.size());
+            if(c.second)
+            {
+                class_sizes.push_back(0);
+                first_words.push_back(i);
+            }
+            word_classes[i] = c.first->second;
+            ++class_sizes[c.first->second];
+        }
+    }
+
+    Index_header header{};
+    std::copy(std::begin(index_magic), std::end(index_magic), header.magic);
+    header.version = index_version;
+    header.byte_order = index_byte_order;
+    header.letter_counts_size = sizeof(Counts);
+    header.flags = flags;
+    header.alphabet_size = alphabet.letters().size();
+    header.num_classes = class_sizes.size();
+    header.num_words = words.size();
+
+    const auto trie = with_trie
+        ? build_trie<Counts>(class_sizes.size(), [&](const std::size_t c) -> const Counts & { return ltrs[first_words[c]]; })
+        : Letter_trie<Counts>();
+    header.num_trie_nodes = trie.classes.size();
+    header.text_size = std::accumulate(words.begin(), words.end(), std::size_t(0),
+            [](std::size_t size, const Text_span & word) { return size + word.size; });
+
+    // record where the words came from, so stale indexes can be detected
+    std::string abs_path = source_path;
+    if(char * resolved = realpath(source_path.c_str(), nullptr))
+    {
+        abs_path = resolved;
+        std::free(resolved);
+    }
+    header.source_path_size = abs_path.size();
+
+    struct stat source_stat;
+    if(stat(source_path.c_str(), &source_stat) == 0)
+    {
+        header.source_size = source_stat.st_size;
+        header.source_mtime = source_stat.st_mtim.tv_sec * 1000000000ll + source_stat.st_mtim.tv_nsec;
+    }
+
+    block_size_ = block_size(header);
+    char * block = static_cast<char *>(::operator new(block_size_));
+    block_.reset(block, [](const char * p) { ::operator delete(const_cast<char *>(p)); });
+    std::fill(block, block + block_size_, 0);
+
+    std::memcpy(block, &header, sizeof(header));
+    std::copy(alphabet.letters().begin(), alphabet.letters().end(), const_cast<std::uint32_t *>(
+                reinterpret_cast<const std::uint32_t *>(block + align_16(sizeof(Index_header)))));
+    set_arrays();
+
+    auto w_ltrs = const_cast<Counts *>(ltrs_);
+    auto w_products = const_cast<std::uint64_t *>(products_);
+    auto w_masks = const_cast<Mask *>(masks_);
+    auto w_class_offsets = const_cast<std::uint32_t *>(class_offsets_);
+    auto w_members = const_cast<std::uint32_t *>(members_);
+    auto w_word_offsets = const_cast<std::uint32_t *>(word_offsets_);
+    auto w_text = const_cast<char *>(text_);
+
+    std::uint32_t offset = 0;
+    for(std::size_t c = 0; c < num_classes_; ++c)
+    {
+        const auto & class_ltrs = ltrs[first_words[c]];
+        w_ltrs[c] = class_ltrs;
+        w_products[c] = letter_product(class_ltrs, alphabet_);
+        w_masks[c] = class_ltrs.mask();
+        w_class_offsets[c] = offset;
+        offset += class_sizes[c];
+    }
+    w_class_offsets[num_classes_] = offset;
+
+    // words were visited in order, so each class's members stay sorted
+    std::vector<std::uint32_t> class_fill(class_offsets_, class_offsets_ + num_classes_);
+    offset = 0;
+    for(std::size_t i = 0; i < words.size(); ++i)
+    {
+        w_members[class_fill[word_classes[i]]++] = i;
+        w_word_offsets[i] = offset;
+        std::memcpy(w_text + offset, text + words[i].offset, words[i].size);
+        offset += words[i].size;
+    }
+    w_word_offsets[words.size()] = offset;
+
+    if(!trie.children.empty())
+        std::copy(trie.children.begin(), trie.children.end(), const_cast<std::uint32_t *>(trie_children_));
+    std::copy(trie.classes.begin(), trie.classes.end(), const_cast<std::uint32_t *>(trie_classes_));
+    std::copy(trie.needs.begin(), trie.needs.end(), const_cast<Mask *>(trie_needs_));
+    std::copy(trie.slots.begin(), trie.slots.end(), const_cast<std::uint8_t *>(trie_slots_));
+    std::memcpy(const_cast<char *>(source_path_), abs_path.data(), abs_path.size());
+
+    auto body = align_16(sizeof(Index_header));
+    reinterpret_cast<Index_header *>(block)->checksum = checksum(block + body, block_size_ - body);
+}
+
+template<class Counts>
+void Word_list<Counts>::set_arrays()
+{
+    const auto & h = header();
+    num_classes_ = h.num_classes;
+    num_words_ = h.num_words;
+
+    auto pos = block_.get() + align_16(sizeof(Index_header));
+    alphabet_letters_ = reinterpret_cast<const std::uint32_t *>(pos);
+    // a pruned view keeps its dictionary's alphabet from one prune to the next
+    if(!(h.flags & UNICODE_ALPHABET))
+    {
+        if(!alphabet_.english())
+            alphabet_ = Alphabet();
+    }
+    else if(alphabet_.english() || alphabet_.letters().size() != h.alphabet_size
+            || !std::equal(alphabet_.letters().begin(), alphabet_.letters().end(), alphabet_letters_))
+        alphabet_ = Alphabet(std::vector<char32_t>(alphabet_letters_, alphabet_letters_ + h.alphabet_size));
+    pos += align_16(h.alphabet_size * sizeof(std::uint32_t));
+    ltrs_ = reinterpret_cast<const Counts *>(pos);
+    pos += align_16(num_classes_ * sizeof(Counts));
+    products_ = reinterpret_cast<const std::uint64_t *>(pos);
+    pos += align_16(num_classes_ * sizeof(std::uint64_t));
+    masks_ = reinterpret_cast<const Mask *>(pos);
+    pos += align_16(num_classes_ * sizeof(Mask));
+    class_offsets_ = reinterpret_cast<const std::uint32_t *>(pos);
+    pos += align_16((num_classes_ + 1) * sizeof(std::uint32_t));
+    members_ = reinterpret_cast<const std::uint32_t *>(pos);
+    pos += align_16(num_words_ * sizeof(std::uint32_t));
+    word_offsets_ = reinterpret_cast<const std::uint32_t *>(pos);
+    pos += align_16((num_words_ + 1) * sizeof(std::uint32_t));
+    text_ = pos;
+    pos += align_16(h.text_size);
+    num_trie_nodes_ = h.num_trie_nodes;
+    trie_children_ = reinterpret_cast<const std::uint32_t *>(pos);
+    pos += align_16((num_trie_nodes_ + 1) * sizeof(std::uint32_t));
+    trie_classes_ = reinterpret_cast<const std::uint32_t *>(pos);
+    pos += align_16(num_trie_nodes_ * sizeof(std::uint32_t));
+    trie_needs_ = reinterpret_cast<const Mask *>(pos);
+    pos += align_16(num_trie_nodes_ * sizeof(Mask));
+    trie_slots_ = reinterpret_cast<const std::uint8_t *>(pos);
+    pos += align_16(num_trie_nodes_ * sizeof(std::uint8_t));
+    source_path_ = pos;
+}
+
+template<class Counts>
+void Word_list<Counts>::prune(const Word_list & dictionary, const Counts & ltrs, const Word_filter & filter)
+{
+    kept_classes_.clear();
+    kept_words_.clear();
+
+    // walk the trie, taking each node's letter from those left, so a path
+    // stops as soon as it runs out of a letter, or of one all the classes
+    // below it still need
+    if(dictionary.num_trie_nodes_)
+        trie_stack_.assign(1, Trie_visit{0, ltrs.mask(), ltrs});
+    else
+    {
+        const auto ltrs_mask = ltrs.mask();
+        for(std::uint32_t c = 0; c < dictionary.num_classes(); ++c)
+        {
+            if(!(dictionary.mask(c) & ~ltrs_mask) && ltrs.contains(dictionary.ltrs(c)))
+                kept_classes_.push_back(c);
+        }
+    }
+    while(!trie_stack_.empty())
+    {
+        const auto visit = trie_stack_.back();
+        trie_stack_.pop_back();
+
+        if(dictionary.trie_classes_[visit.node] != Letter_trie<Counts>::no_class)
+            kept_classes_.push_back(dictionary.trie_classes_[visit.node]);
+
+        for(auto child = dictionary.trie_children_[visit.node]; child < dictionary.trie_children_[visit.node + 1]; ++child)
+        {
+            const auto slot = dictionary.trie_slots_[child];
+            if(!visit.ltrs[slot])
+                continue;
+
+            const auto mask = visit.ltrs[slot] == 1 ? visit.mask & ~(Mask(1) << slot) : visit.mask;
+            if(dictionary.trie_needs_[child] & ~mask)
+                continue;
+
+            trie_stack_.push_back(Trie_visit{child, mask, visit.ltrs});
+            --trie_stack_.back().ltrs[slot];
+        }
+    }
+
+    // keep the classes and words in the dictionary's order
+    std::sort(kept_classes_.begin(), kept_classes_.end());
+    std::size_t text_size = 0;
+    std::size_t num_kept = 0;
+    for(auto c: kept_classes_)
+    {
+        if(!filter.keeps_length(dictionary.ltrs(c).total()))
+            continue;
+
+        const auto words_before = kept_words_.size();
+        for(std::size_t j = 0; j < dictionary.class_size(c); ++j)
+        {
+            const auto w = dictionary.class_word(c, j);
+            if(filter.excludes(w))
+                continue;
+            kept_words_.push_back(w);
+            text_size += dictionary.word_size(w);
+        }
+        if(kept_words_.size() > words_before)
+            kept_classes_[num_kept++] = c;
+    }
+    kept_classes_.resize(num_kept);
+    std::sort(kept_words_.begin(), kept_words_.end());
+
+    Index_header header = dictionary.header();
+    header.num_classes = kept_classes_.size();
+    header.num_words = kept_words_.size();
+    header.num_trie_nodes = 0;
+    header.text_size = text_size;
+    header.source_path_size = 0;
+    header.checksum = 0;
+
+    block_size_ = block_size(header);
+    if(!block_ || block_.use_count() != 1 || block_capacity_ < block_size_)
+    {
+        block_capacity_ = std::max(block_size_, block_capacity_ * 2);
+        block_.reset(static_cast<char *>(::operator new(block_capacity_)), [](const char * p) { ::operator delete(const_cast<char *>(p)); });
+    }
+
+    char * block = const_cast<char *>(block_.get());
+    std::memcpy(block, &header, sizeof(header));
+    std::copy(dictionary.alphabet_letters_, dictionary.alphabet_letters_ + header.alphabet_size,
+              reinterpret_cast<std::uint32_t *>(block + align_16(sizeof(Index_header))));
+    set_arrays();
+
+    auto w_ltrs = const_cast<Counts *>(ltrs_);
+    auto w_products = const_cast<std::uint64_t *>(products_);
+    auto w_masks = const_cast<Mask *>(masks_);
+    auto w_class_offsets = const_cast<std::uint32_t *>(class_offsets_);
+    auto w_members = const_cast<std::uint32_t *>(members_);
+    auto w_word_offsets = const_cast<std::uint32_t *>(word_offsets_);
+    auto w_text = const_cast<char *>(text_);
+
+    std::uint32_t offset = 0;
+    for(std::size_t w = 0; w < kept_words_.size(); ++w)
+    {
+        const auto size = dictionary.word_size(kept_words_[w]);
+        w_word_offsets[w] = offset;
+        std::memcpy(w_text + offset, dictionary.word(kept_words_[w]), size);
+        offset += size;
+    }
+    w_word_offsets[kept_words_.size()] = offset;
+
+    // members are renumbered in order, so each class's stay sorted
+    offset = 0;
+    for(std::size_t c = 0; c < kept_classes_.size(); ++c)
+    {
+        const auto class_i = kept_classes_[c];
+        w_ltrs[c] = dictionary.ltrs(class_i);
+        w_products[c] = dictionary.product(class_i);
+        w_masks[c] = dictionary.mask(class_i);
+        w_class_offsets[c] = offset;
+        for(std::size_t j = 0; j < dictionary.class_size(class_i); ++j)
+        {
+            const auto w = dictionary.class_word(class_i, j);
+            if(!filter.excludes(w))
+                w_members[offset++] = std::lower_bound(kept_words_.begin(), kept_words_.end(), w) - kept_words_.begin();
+        }
+    }
+    w_class_offsets[kept_classes_.size()] = offset;
+}
+
+template<class Counts>
+Word_list<Counts> Word_list<Counts>::map_index(const std::string & path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Error opening " + path + ": " + std::strerror(errno));
+
+    struct stat index_stat;
+    if(fstat(fd, &index_stat) != 0)
+    {
+        auto err = errno;
+        close(fd);
+        throw std::runtime_error("Error reading " + path + ": " + std::strerror(err));
+    }
+
+    std::size_t size = index_stat.st_size;
+    if(size < sizeof(Index_header))
+    {
+        close(fd);
+        throw std::runtime_error(path + " is not an anagram index");
+    }
+
+    void * map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto err = errno;
+    close(fd);
+    if(map == MAP_FAILED)
+        throw std::runtime_error("Error reading " + path + ": " + std::strerror(err));
+
+    Word_list dictionary;
+    dictionary.block_.reset(static_cast<const char *>(map), [size](const char * p) { munmap(const_cast<char *>(p), size); });
+    dictionary.block_size_ = size;
+
+    const auto & header = dictionary.header();
+    if(!std::equal(std::begin(index_magic), std::end(index_magic), header.magic))
+        throw std::runtime_error(path + " is not an anagram index");
+
+    if(header.version != index_version
+            || header.byte_order != index_byte_order
+            || header.letter_counts_size != sizeof(Counts))
+    {
+        throw std::runtime_error(path + " was built by an incompatible version of anagram. Rebuild it with --build-index");
+    }
+
+    if(header.num_words >= std::numeric_limits<std::uint32_t>::max()
+            || header.num_classes > header.num_words
+            || header.num_trie_nodes > size
+            || header.alphabet_size > Counts::slots
+            || (header.alphabet_size != 0) != ((header.flags & UNICODE_ALPHABET) != 0)
+            || header.text_size > size
+            || header.source_path_size > size
+            || block_size(header) != size)
+    {
+        throw std::runtime_error(path + " is corrupt. Rebuild it with --build-index");
+    }
+
+    auto body = align_16(sizeof(Index_header));
+    if(checksum(dictionary.block_.get() + body, size - body) != header.checksum)
+        throw std::runtime_error(path + " is corrupt. Rebuild it with --build-index");
+
+    dictionary.set_arrays();
+
+    std::string source_path(dictionary.source_path_, header.source_path_size);
+    struct stat source_stat;
+    if(!source_path.empty() && stat(source_path.c_str(), &source_stat) == 0)
+    {
+        if(static_cast<std::uint64_t>(source_stat.st_size) != header.source_size
+                || source_stat.st_mtim.tv_sec * 1000000000ll + source_stat.st_mtim.tv_nsec != header.source_mtime)
+        {
+            throw std::runtime_error(path + " is stale: " + source_path + " has changed since it was built. Rebuild it with --build-index");
+        }
+    }
+
+    return dictionary;
+}
+
+template<class Counts>
+void Word_list<Counts>::write_index(const std::string & path) const
+{
+    // write to a temporary file first, so a failed write never leaves a
+    // partial index behind
+    std::string tmp_path = path + ".tmp";
+    std::ofstream index_file(tmp_path, std::ios::binary);
+    if(index_file)
+        index_file.write(block_.get(), block_size_);
+    if(index_file)
+        index_file.close();
+
+    if(!index_file || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        auto err = errno;
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Error writing " + path + ": " + std::strerror(err));
+    }
+}
+
+struct Search_stats
+{
+    // how classes tested for fit at each node were rejected
+    std::uint64_t tested = 0;
+    std::uint64_t mask_rejected = 0; // contains a letter not remaining
+    std::uint64_t prime_rejected = 0; // prime product doesn't divide the remaining letters'
+    std::uint64_t count_rejected = 0; // failed the full letter count check
+
+    // anagrams found, whether printed or only counted
+    std::uint64_t full_anagrams = 0;
+    std::uint64_t partial_anagrams = 0;
+
+    // see Memo_cache
+    std::uint64_t memo_hits = 0;
+    std::uint64_t memo_misses = 0;
+    std::uint64_t memo_evictions = 0;
+    std::uint64_t memo_peak_bytes = 0;
+
+    std::uint64_t bound_pruned = 0; // branches skipped as unable to make --best
+
+    // the dictionary's classes and words that Word_list::prune kept for the
+    // search, and that it removed as unable to fit the input
+    std::uint64_t classes_kept = 0;
+    std::uint64_t classes_removed = 0;
+    std::uint64_t words_kept = 0;
+    std::uint64_t words_removed = 0;
+
+    // nodes entered, and classes tested for fit at them, by their depth: the
+    // number of words chosen above them
+    struct Depth
+    {
+        std::uint64_t nodes = 0;
+        std::uint64_t tested = 0;
+    };
+    std::vector<Depth> depths;
+
+    std::uint64_t allocations = 0; // heap allocations by every thread during the search
+
+    double search_seconds = 0; // from start to finish
+    double output_seconds = 0; // writing output, summed over every thread
+
+    Search_stats & operator+=(const Search_stats & other)
+    {
+        tested += other.tested;
+        mask_rejected += other.mask_rejected;
+        prime_rejected += other.prime_rejected;
+        count_rejected += other.count_rejected;
+        full_anagrams += other.full_anagrams;
+        partial_anagrams += other.partial_anagrams;
+        memo_hits += other.memo_hits;
+        memo_misses += other.memo_misses;
+        memo_evictions += other.memo_evictions;
+        memo_peak_bytes += other.memo_peak_bytes;
+        bound_pruned += other.bound_pruned;
+        classes_kept += other.classes_kept;
+        classes_removed += other.classes_removed;
+        words_kept += other.words_kept;
+        words_removed += other.words_removed;
+        if(depths.size() < other.depths.size())
+            depths.resize(other.depths.size());
+        for(std::size_t i = 0; i < other.depths.size(); ++i)
+        {
+            depths[i].nodes += other.depths[i].nodes;
+            depths[i].tested += other.depths[i].tested;
+        }
+        allocations += other.allocations;
+        search_seconds += other.search_seconds;
+        output_seconds += other.output_seconds;
+        return *this;
+    }
+};
+
+// Adds the time from its construction to its destruction to seconds, when
+// collecting stats
+class Stats_timer
+{
+public:
+    explicit Stats_timer(double & seconds):
+        seconds_(seconds),
+        start_(collect_stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point())
+    {}
+
+    ~Stats_timer()
+    {
+        if(collect_stats)
+            seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    double & seconds_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Write buffers to fd with as few system calls as possible, bypassing
+// iostreams. Like std::cout, gives up silently on error
+void write_output(const int fd, iovec * iov, std::size_t count)
+{
+    while(count > 0)
+    {
+        auto written = ::writev(fd, iov, static_cast<int>(std::min<std::size_t>(count, IOV_MAX)));
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        // skip what was written, which may end part way through a buffer
+        for(; count > 0 && static_cast<std::size_t>(written) >= iov->iov_len; ++iov, --count)
+            written -= iov->iov_len;
+        if(count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+void write_output(const int fd, const std::string & text)
+{
+    iovec iov{const_cast<char *>(text.data()), text.size()};
+    write_output(fd, &iov, 1);
+}
+
+// A run of output from one thread. When output is ordered, segments are linked
+// in the order a single-threaded search would have printed them, and each is
+// printed only once every segment before it has been
+struct Output_segment
+{
+    std::string text;
+    bool complete = false;
+    Output_segment * next = nullptr;
+};
+
+// A node of the search, memoized: the classes that fit at that node, each
+// with the node it leads to. Enumerating it gives the same results, in the
+// same order, as searching the node again. Nodes are shared between every
+// node of the search with the same letters left, making a DAG
+struct Memo_node
+{
+    struct Edge
+    {
+        std::uint32_t class_i;
+        bool full; // uses up all the letters
+        std::shared_ptr<const Memo_node> child; // null if nothing follows
+    };
+    std::vector<Edge> edges;
+
+    // bytes used by the node, counted in *live_bytes while it exists
+    std::size_t bytes = 0;
+    std::size_t * live_bytes = nullptr;
+
+    ~Memo_node()
+    {
+        if(live_bytes)
+            *live_bytes -= bytes;
+    }
+};
+
+// Memoized search nodes, keyed on the letters left, and the first class that
+// may be used (combinations only use classes at or after the last one used,
+// so the same letters can have different completions). Least recently used
+// nodes are evicted to keep the memory used under a limit. Nodes evicted
+// while still used by another node live on until that one is evicted too, and
+// count towards the limit until then
+template<class Counts>
+class Memo_cache
+{
+public:
+    explicit Memo_cache(const std::size_t max_bytes):
+        max_bytes_(max_bytes),
+        empty_node_(std::make_shared<Memo_node>())
+    {}
+    ~Memo_cache()
+    {
+        // nodes must not outlive live_bytes_
+        index_.clear();
+        lru_.clear();
+    }
+
+    // a node for a search with no candidates
+    const std::shared_ptr<const Memo_node> & empty_node() const { return empty_node_; }
+
+    std::shared_ptr<const Memo_node> find(const Counts & ltrs, const std::uint32_t first_class, Search_stats & stats)
+    {
+        auto found = index_.find(Key{ltrs, first_class});
+        if(found == index_.end())
+        {
+            if(collect_stats)
+                ++stats.memo_misses;
+            return nullptr;
+        }
+
+        if(collect_stats)
+            ++stats.memo_hits;
+        lru_.splice(lru_.begin(), lru_, found->second);
+        return found->second->second;
+    }
+
+    // a node, counting towards the memory limit, for filling in then inserting
+    std::shared_ptr<Memo_node> make_node()
+    {
+        auto node = std::make_shared<Memo_node>();
+        node->live_bytes = &live_bytes_;
+        return node;
+    }
+
+    void insert(const Counts & ltrs,
+                const std::uint32_t first_class,
+                const std::shared_ptr<Memo_node> & node,
+                Search_stats & stats)
+    {
+        node->edges.shrink_to_fit();
+        node->bytes = sizeof(Memo_node) + node->edges.size() * sizeof(Memo_node::Edge) + entry_bytes;
+        live_bytes_ += node->bytes;
+
+        Key key{ltrs, first_class};
+        lru_.emplace_front(key, node);
+        auto inserted = index_.emplace(key, lru_.begin());
+        if(!inserted.second)
+        {
+            // already found by another path, during this node's search
+            lru_.pop_front();
+            return;
+        }
+
+        while(live_bytes_ > max_bytes_ && !lru_.empty())
+        {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+            if(collect_stats)
+                ++stats.memo_evictions;
+        }
+
+        if(collect_stats)
+            stats.memo_peak_bytes = std::max<std::uint64_t>(stats.memo_peak_bytes, live_bytes_);
+    }
+
+private:
+    struct Key
+    {
+        Counts ltrs;
+        std::uint32_t first_class;
+
+        bool operator==(const Key & other) const
+        {
+            return first_class == other.first_class && ltrs == other.ltrs;
+        }
+    };
+
+    struct Key_hash
+    {
+        std::size_t operator()(const Key & key) const
+        {
+            return Letter_counts_hash()(key.ltrs, key.first_class);
+        }
+    };
+
+    typedef std::list<std::pair<Key, std::shared_ptr<const Memo_node>>> Lru_list;
+
+    // rough overhead of each entry in lru_ and index_
+    static const std::size_t entry_bytes = sizeof(typename Lru_list::value_type) + 2 * sizeof(void *)
+        + sizeof(std::pair<const Key, typename Lru_list::iterator>) + 2 * sizeof(void *);
+
+    const std::size_t max_bytes_;
+    std::size_t live_bytes_ = 0;
+    std::shared_ptr<const Memo_node> empty_node_;
+    Lru_list lru_; // most recently used first
+    std::unordered_map<Key, typename Lru_list::iterator, Key_hash> index_;
+};
+
+struct Search_options
+{
+    bool show_partial = false;
+    bool permutations = false;
+    bool prime_filter = false; // see letter_product
+    bool count_only = false; // count anagrams instead of printing them
+    std::size_t memo_bytes = 0; // memory limit of each thread's Memo_cache. 0 to disable it
+    std::uint64_t limit = 0; // stop after this many full anagrams. 0 for no limit
+
+    // search only shard (from 0) of num_shards parts of the search, for --shard. See shard_parts
+    std::size_t shard = 0;
+    std::size_t num_shards = 1;
+
+    // words every anagram has, upper-cased and sorted, whose letters the
+    // search's input leaves out (--include), the most words the search may
+    // add to them (--max-words), and which words it may use
+    std::vector<std::string> include;
+    std::size_t max_words = std::numeric_limits<std::size_t>::max();
+    Word_filter filter;
+
+    // print only the best this many full anagrams by score. 0 to print all
+    enum Score {FEWEST_WORDS, LONGEST_WORD};
+    std::uint64_t best = 0;
+    Score score = FEWEST_WORDS;
+};
+
+// The best full anagrams found so far, kept as groups of classes, for --best.
+// Scores are lower for better anagrams. Groups are kept, best first and then
+// in canonical order of their classes, so ties are broken the same way
+// whatever the number of threads, while the groups better than them stand for
+// fewer than n anagrams. Shared between threads
+class Best_anagrams
+{
+public:
+    struct Entry
+    {
+        int score;
+        std::vector<std::uint32_t> classes;
+        std::uint64_t count; // anagrams the classes stand for
+
+        bool operator<(const Entry & other) const
+        {
+            return score < other.score || (score == other.score && classes < other.classes);
+        }
+    };
+
+    explicit Best_anagrams(const std::uint64_t n): n_(n) {}
+
+    // true if a group scoring score can't be kept. Groups tying the worst kept
+    // score aren't rejected, as they may come before it in canonical order
+    bool rejects(const int score) const
+    {
+        return score > threshold_.load(std::memory_order_relaxed);
+    }
+
+    void offer(const std::vector<std::uint32_t> & classes, const std::uint64_t count, const int score)
+    {
+        if(rejects(score))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(rejects(score))
+            return;
+
+        entries_.insert(Entry{score, classes, count});
+        total_ += count;
+
+        // drop groups that the ones better than them already fill n with
+        while(total_ - std::prev(entries_.end())->count >= n_)
+        {
+            total_ -= std::prev(entries_.end())->count;
+            entries_.erase(std::prev(entries_.end()));
+        }
+        if(total_ >= n_)
+            threshold_ = std::prev(entries_.end())->score;
+    }
+
+    // best first. Only valid once the search is done
+    const std::set<Entry> & entries() const { return entries_; }
+
+private:
+    const std::uint64_t n_;
+    std::atomic<int> threshold_{std::numeric_limits<int>::max()}; // highest score kept
+    std::mutex mutex_; // guards everything below
+    std::set<Entry> entries_;
+    std::uint64_t total_ = 0;
+};
+
+// State shared by every thread of one search
+struct Search_shared
+{
+    std::atomic<std::uint64_t> full_found{0}; // counted only when the search has a limit
+    std::unique_ptr<Best_anagrams> best; // set when only the best anagrams are wanted
+
+    explicit Search_shared(const Search_options & options)
+    {
+        if(options.best)
+            best.reset(new Best_anagrams(options.best));
+    }
+
+    // true once the search has found all it was asked to
+    bool done(const Search_options & options) const
+    {
+        return options.limit && full_found.load(std::memory_order_relaxed) >= options.limit;
+    }
+};
+
+// A node on a worker's stack, whose branches are being searched
+template<class Counts>
+struct Search_frame
+{
+    Counts ltrs;
+    std::size_t list_begin, list_end; // the node's list of candidates, in worker.candidates
+    std::size_t branch, last; // the next branch to search, and the end of those to search
+    bool complete; // no branch was handed off or cut short
+    bool donated; // some branches were handed off to another thread
+    Output_segment * continuation; // segment to switch to once done, after donating
+    std::shared_ptr<Memo_node> node; // being memoized, if any
+    std::uint32_t first_class; // node's memo key
+};
+
+template<class Counts>
+class Work_pool;
+
+// Where and how often a single-threaded search saves its state, for
+// --checkpoint, and whether it carries on from the state saved there
+struct Checkpoint_settings
+{
+    std::string path;
+    std::chrono::steady_clock::duration interval;
+    bool resume = false;
+};
+
+// Per-thread search state
+template<class Counts>
+struct Worker
+{
+    Work_pool<Counts> * pool = nullptr; // null when searching on a single thread
+    Search_shared * shared = nullptr;
+    std::size_t id = 0;
+    int fd = STDOUT_FILENO; // where output is written
+    std::mutex * fd_mutex = nullptr; // held while writing, when not using a pool and other threads write to fd too
+    std::string tag; // put before each line of output
+    std::string buffer; // pending output when unordered
+    Output_segment * segment = nullptr; // current output when ordered
+
+    // where output goes until it's written
+    std::string & output() { return segment ? segment->text : buffer; }
+
+    // output is written once it reaches this size
+    static const std::size_t flush_size = 1 << 16;
+
+    // make ready for a new search, keeping the memory allocated so far
+    void reset()
+    {
+        segment = nullptr;
+        buffer.clear();
+        tag.clear();
+        stats = Search_stats();
+        memo.reset();
+        candidates.clear();
+        prefix.clear();
+        stack.clear();
+        shard_part = 0;
+    }
+
+    Search_stats stats;
+    std::unique_ptr<Memo_cache<Counts>> memo;
+
+    // the dictionary pruned to the current search's letters
+    Word_list<Counts> view;
+
+    // Classes of words that still fit at each level of the
+    // current branch, each level's list following its parent's. Reused for
+    // the whole search, so it only allocates until it reaches its peak size
+    std::vector<std::uint32_t> candidates;
+    std::vector<std::uint32_t> prefix; // classes used so far
+
+    // nodes from the top of the current search down to the one being searched
+    std::vector<Search_frame<Counts>> stack;
+
+    // saving the search's state to resume from, when set. See save_checkpoint
+    const Checkpoint_settings * checkpoint = nullptr;
+    std::uint64_t checkpoint_key = 0; // search_key of the current search
+    std::size_t shard_part = 0; // the part being searched of a sharded search, see search_shard
+    std::chrono::steady_clock::time_point next_checkpoint;
+    std::size_t checkpoint_countdown = 0; // nodes to search before next looking at the clock
+
+    // scratch space for output_anagrams
+    std::vector<std::uint32_t> choice;
+    std::vector<std::uint32_t> words;
+    std::vector<std::uint32_t> line_words; // words in line
+    std::string line;
+    std::vector<std::size_t> word_ends; // where each word ends in line
+};
+
+// Spreads a search over several threads. The root's branches are split between
+// threads as they go idle. Each thread keeps its own queue of work, taking the
+// most recently added task from its own queue, or stealing the oldest from
+// another's. When a thread runs dry while others are still searching, they
+// split off half of the branches they have left at their current level
+template<class Counts>
+class Work_pool
+{
+public:
+    Work_pool(const Word_list<Counts> & dictionary,
+              const std::size_t num_threads,
+              const bool ordered,
+              const Search_options & options,
+              Search_shared & shared,
+              const int fd = STDOUT_FILENO):
+        dictionary_(dictionary),
+        num_threads_(num_threads),
+        ordered_(ordered),
+        options_(options),
+        shared_(shared),
+        fd_(fd),
+        queues_(num_threads)
+    {}
+
+    // search from ltrs, returning once every thread is done
+    void run(const Counts & ltrs);
+
+    // true when another thread is waiting for work that hasn't been queued yet
+    bool hungry() const
+    {
+        return idle_.load(std::memory_order_relaxed) > queued_.load(std::memory_order_relaxed);
+    }
+
+    // give branches [first, last) of the node at the end of the worker's
+    // prefix to another thread. [list_begin, list_end) is that node's list of
+    // candidates. When continuation is set and output is ordered, returns a
+    // new segment for the caller to switch to once it has finished the
+    // branches it kept
+    Output_segment * donate(Worker<Counts> & worker,
+                            const Counts & ltrs,
+                            const std::size_t list_begin,
+                            const std::size_t list_end,
+                            const std::size_t first,
+                            const std::size_t last,
+                            const bool continuation)
+    {
+        Task task{ltrs,
+                  worker.prefix,
+                  std::vector<std::uint32_t>(worker.candidates.begin() + list_begin, worker.candidates.begin() + list_end),
+                  first - list_begin,
+                  last - list_begin,
+                  nullptr};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        Output_segment * next = nullptr;
+        if(ordered_)
+        {
+            task.segment = new Output_segment;
+            if(continuation)
+            {
+                next = new Output_segment;
+                task.segment->next = next;
+                next->next = worker.segment->next;
+            }
+            else
+                task.segment->next = worker.segment->next;
+
+            worker.segment->next = task.segment;
+        }
+
+        queues_[worker.id].push_back(std::move(task));
+        ++queued_;
+        cv_.notify_one();
+
+        return next;
+    }
+
+    // write the worker's output, if it's not waiting on earlier segments
+    void flush(Worker<Counts> & worker)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // ordered output can only be written once it reaches the head
+        if(!ordered_ || worker.segment == head_)
+        {
+            Stats_timer timer(worker.stats.output_seconds);
+            auto & text = worker.output();
+            write_output(worker.fd, text);
+            text.clear();
+        }
+    }
+
+    // mark the worker's current segment complete, and move it on to next
+    void finish_segment(Worker<Counts> & worker, Output_segment * next)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        worker.segment->complete = true;
+        worker.segment = next;
+
+        // write every complete segment at the head together
+        Stats_timer timer(worker.stats.output_seconds);
+        std::vector<iovec> iov;
+        auto segment = head_;
+        for(; segment && segment->complete; segment = segment->next)
+        {
+            if(!segment->text.empty())
+                iov.push_back(iovec{&segment->text[0], segment->text.size()});
+        }
+        write_output(fd_, iov.data(), iov.size());
+
+        while(head_ != segment)
+        {
+            auto old_head = head_;
+            head_ = head_->next;
+            delete old_head;
+        }
+    }
+
+    bool ordered() const { return ordered_; }
+
+    // totals from every thread. Only valid once run has returned
+    const Search_stats & stats() const { return stats_; }
+
+private:
+    // a node's remaining letters, prefix and candidates, and the range of its
+    // branches to search
+    struct Task
+    {
+        Counts ltrs;
+        std::vector<std::uint32_t> prefix;
+        std::vector<std::uint32_t> candidates;
+        std::size_t first, last;
+        Output_segment * segment;
+    };
+
+    void work(const std::size_t id, const Counts * ltrs);
+
+    // wait for a task, after finishing the previous one if finished is set.
+    // Returns false once all threads have run out of work
+    bool next_task(const std::size_t id, Task & task, const bool finished)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if(finished)
+            --busy_;
+
+        while(true)
+        {
+            if(!queues_[id].empty())
+            {
+                task = std::move(queues_[id].back());
+                queues_[id].pop_back();
+                break;
+            }
+
+            auto victim = std::find_if(queues_.begin(), queues_.end(), [](const std::deque<Task> & q){ return !q.empty(); });
+            if(victim != queues_.end())
+            {
+                task = std::move(victim->front());
+                victim->pop_front();
+                break;
+            }
+
+            if(busy_ == 0)
+            {
+                cv_.notify_all();
+                return false;
+            }
+
+            ++idle_;
+            cv_.wait(lock);
+            --idle_;
+        }
+
+        --queued_;
+        ++busy_;
+        return true;
+    }
+
+    const Word_list<Counts> & dictionary_;
+    const std::size_t num_threads_;
+    const bool ordered_;
+    const Search_options options_;
+    Search_shared & shared_;
+    const int fd_; // where output is written
+
+    std::mutex mutex_; // guards everything below, and writing to fd_
+    std::condition_variable cv_;
+    std::vector<std::deque<Task>> queues_;
+    std::atomic<std::size_t> queued_{0};
+    std::atomic<std::size_t> idle_{0};
+    std::size_t busy_ = 0;
+    Output_segment * head_ = nullptr;
+    Search_stats stats_;
+};
+
+// Write the worker's output so far, or as much of it as can be written yet
+template<class Counts>
+void flush_output(Worker<Counts> & worker)
+{
+    if(worker.pool)
+        worker.pool->flush(worker);
+    else
+    {
+        std::unique_lock<std::mutex> lock;
+        if(worker.fd_mutex)
+            lock = std::unique_lock<std::mutex>(*worker.fd_mutex);
+        Stats_timer timer(worker.stats.output_seconds);
+        write_output(worker.fd, worker.buffer);
+        worker.buffer.clear();
+    }
+}
+
+// n choose k
+inline std::uint64_t choose(const std::uint64_t n, const std::uint64_t k)
+{
+    std::uint64_t result = 1;
+    for(std::uint64_t i = 1; i <= k; ++i)
+        result = result * (n - k + i) / i;
+    return result;
+}
+
+// Orderings of length words from a class, where others of its words aren't
+// included, and each included word from include[i] on that in_class says is
+// one of its words appears at least as many times as it's included
+template<class In_class>
+std::uint64_t class_orderings(const std::uint64_t others,
+                              const std::uint64_t length,
+                              const std::vector<std::string> & include,
+                              std::size_t i,
+                              In_class in_class)
+{
+    while(i < include.size() && !in_class(i))
+        ++i;
+    if(i == include.size())
+    {
+        std::uint64_t ways = 1;
+        for(std::uint64_t k = 0; k < length; ++k)
+            ways *= others;
+        return ways;
+    }
+
+    // include is sorted, so copies of a word are together
+    auto next = i + 1;
+    while(next < include.size() && include[next] == include[i])
+        ++next;
+
+    // choose the places of every copy of include[i], then fill the rest
+    std::uint64_t ways = 0;
+    for(auto copies = next - i; copies <= length; ++copies)
+        ways += choose(length, copies) * class_orderings(others, length - copies, include, next, in_class);
+    return ways;
+}
+
+// The number of anagrams that output_anagrams would print for classes
+template<class Counts>
+std::uint64_t count_anagrams(const Word_list<Counts> & dictionary,
+                             const std::vector<std::uint32_t> & classes,
+                             const Search_options & options)
+{
+    const auto & include = options.include;
+
+    // whether include[j] is one of class_i's words
+    auto in_class = [&](const std::uint32_t class_i, const std::size_t j)
+    {
+        for(std::size_t i = 0; i < dictionary.class_size(class_i); ++i)
+        {
+            const auto w = dictionary.class_word(class_i, i);
+            if(dictionary.word_size(w) == include[j].size() && std::memcmp(dictionary.word(w), include[j].data(), include[j].size()) == 0)
+                return true;
+        }
+        return false;
+    };
+
+    std::uint64_t count = 1;
+    std::uint64_t placed = 0; // positions taken by the classes before i
+    for(std::size_t i = 0; i < classes.size();)
+    {
+        const auto class_i = classes[i];
+        const std::uint64_t size = dictionary.class_size(class_i);
+        std::uint64_t k = 0;
+        while(i < classes.size() && classes[i] == class_i)
+            ++i, ++k;
+
+        if(!options.permutations)
+        {
+            // a class used k times chooses a multiset of k of its words:
+            // (size + k - 1) choose k ways
+            count *= choose(size + k - 1, k);
+            continue;
+        }
+
+        // for permutations, the class's words and the included words that
+        // are also its words share their positions, and each ordering of
+        // them is a different line. They take (placed + length) choose length
+        // of the positions so far
+        std::uint64_t length = k;
+        std::uint64_t others = size;
+        for(std::size_t j = 0; j < include.size(); ++j)
+        {
+            if(in_class(class_i, j))
+            {
+                ++length;
+                others -= j == 0 || include[j] != include[j - 1];
+            }
+        }
+        count *= class_orderings(others, length, include, 0, [&](const std::size_t j) { return in_class(class_i, j); })
+            * choose(placed + length, length);
+        placed += length;
+    }
+
+    // the rest of the included words take their places among the others too
+    if(options.permutations)
+    {
+        for(std::size_t j = 0; j < include.size();)
+        {
+            std::uint64_t copies = 0;
+            for(; j < include.size() && include[j] == include[j - copies]; ++j)
+                ++copies;
+            if(std::none_of(classes.begin(), classes.end(), [&](const std::uint32_t class_i) { return in_class(class_i, j - 1); }))
+            {
+                count *= choose(placed + copies, copies);
+                placed += copies;
+            }
+        }
+    }
+    return count;
+}
+
+// Score of a full anagram made of classes, for --best. Lower is better
+template<class Counts>
+int anagram_score(const Word_list<Counts> & dictionary,
+                  const std::vector<std::uint32_t> & classes,
+                  const Search_options & options)
+{
+    if(options.score == Search_options::FEWEST_WORDS)
+        return static_cast<int>(classes.size());
+
+    std::size_t longest = 0;
+    for(auto class_i: classes)
+        longest = std::max(longest, dictionary.ltrs(class_i).total());
+    return -static_cast<int>(longest);
+}
+
+// Print every anagram that the classes in worker.prefix stand for: each group
+// of words with a class's words chosen at most once per use of the class, and
+// the included words, and for permutations, each distinct ordering of each
+// group. The search only finds combinations, so this is where permutations
+// come from
+template<class Counts>
+void output_anagrams(const Word_list<Counts> & dictionary,
+                     const bool full,
+                     const Search_options & options,
+                     Worker<Counts> & worker)
+{
+    const auto & classes = worker.prefix;
+
+    if(worker.shared->done(options))
+        return;
+
+    if(options.best)
+    {
+        worker.shared->best->offer(classes, count_anagrams(dictionary, classes, options), anagram_score(dictionary, classes, options));
+        return;
+    }
+
+    if(options.count_only)
+    {
+        auto count = count_anagrams(dictionary, classes, options);
+        if(full && options.limit)
+        {
+            auto before = worker.shared->full_found.fetch_add(count);
+            count = before >= options.limit ? 0 : std::min(count, options.limit - before);
+        }
+        (full ? worker.stats.full_anagrams : worker.stats.partial_anagrams) += count;
+        return;
+    }
+
+    auto & choice = worker.choice;
+    auto & words = worker.words;
+    auto & line_words = worker.line_words;
+    auto & line = worker.line;
+    auto & word_ends = worker.word_ends;
+
+    // included words are numbered after the dictionary's, in the line's words
+    const auto n = classes.size();
+    const auto num_words = dictionary.num_words();
+    const auto & include = options.include;
+    const auto size = n + include.size();
+    choice.assign(n, 0);
+    words.resize(size);
+    word_ends.resize(size);
+
+    auto word_data = [&](std::uint32_t w) { return w < num_words ? dictionary.word(w) : include[w - num_words].data(); };
+    auto word_size = [&](std::uint32_t w) { return w < num_words ? dictionary.word_size(w) : include[w - num_words].size(); };
+
+    // alphabetical order, which is the order of the dictionary's indices
+    auto word_less = [&](std::uint32_t a, std::uint32_t b)
+    {
+        if(a < num_words && b < num_words)
+            return a < b;
+        auto cmp = std::memcmp(word_data(a), word_data(b), std::min(word_size(a), word_size(b)));
+        return cmp < 0 || (cmp == 0 && word_size(a) < word_size(b));
+    };
+
+    // each line only rebuilds the words after those it shares with the last
+    line.clear();
+    if(options.show_partial)
+        line = full ? "* " : "  ";
+    const auto line_start = line.size();
+    line_words.clear();
+
+    // classes repeat consecutively, and choose their words in non-decreasing
+    // order, so each group is only generated once
+    auto first_choice = [&](std::size_t i)
+    {
+        return (i > 0 && classes[i] == classes[i - 1]) ? choice[i - 1] : 0;
+    };
+
+    while(true)
+    {
+        for(std::size_t i = 0; i < n; ++i)
+            words[i] = dictionary.class_word(classes[i], choice[i]);
+        for(std::size_t j = 0; j < include.size(); ++j)
+            words[n + j] = num_words + j;
+
+        // word indices are in alphabetical order. Permutations of the group
+        // then follow in alphabetical order, each repeated word only
+        // swapping places with different ones
+        if(include.empty())
+            std::sort(words.begin(), words.end());
+        else
+            std::sort(words.begin(), words.end(), word_less);
+        do
+        {
+            // claim a place among the limited results
+            if(options.limit && (full ? worker.shared->full_found.fetch_add(1) >= options.limit : worker.shared->done(options)))
+                return;
+
+            std::size_t same = 0;
+            while(same < line_words.size() && words[same] == line_words[same])
+                ++same;
+            line_words = words;
+
+            line.resize(same ? word_ends[same - 1] : line_start);
+            for(std::size_t i = same; i < size; ++i)
+            {
+                if(i != 0)
+                    line += ' ';
+                line.append(word_data(words[i]), word_size(words[i]));
+                word_ends[i] = line.size();
+            }
+
+            auto & output = worker.output();
+            output += worker.tag;
+            output += line;
+            output += '\n';
+            if(output.size() >= Worker<Counts>::flush_size)
+                flush_output(worker);
+            ++(full ? worker.stats.full_anagrams : worker.stats.partial_anagrams);
+        }
+        while(options.permutations && (include.empty()
+                                       ? std::next_permutation(words.begin(), words.end())
+                                       : std::next_permutation(words.begin(), words.end(), word_less)));
+
+        // advance to the next choice of words, like an odometer
+        std::size_t i = n;
+        while(i > 0 && ++choice[i - 1] == dictionary.class_size(classes[i - 1]))
+            --i;
+
+        if(i == 0)
+            break;
+
+        for(; i < n; ++i)
+            choice[i] = first_choice(i);
+    }
+}
+
+// Print everything found under a memoized node, in the order searching it
+// would have, with the classes in worker.prefix before each
+template<class Counts>
+void output_memo(const Memo_node & node,
+                 const Word_list<Counts> & dictionary,
+                 const Search_options & options,
+                 Worker<Counts> & worker)
+{
+    if(worker.shared->done(options))
+        return;
+
+    for(const auto & edge: node.edges)
+    {
+        if(options.show_partial || edge.full)
+        {
+            worker.prefix.push_back(edge.class_i);
+            output_anagrams(dictionary, edge.full, options, worker);
+            worker.prefix.pop_back();
+        }
+    }
+
+    for(const auto & edge: node.edges)
+    {
+        if(edge.child)
+        {
+            worker.prefix.push_back(edge.class_i);
+            output_memo(*edge.child, dictionary, options, worker);
+            worker.prefix.pop_back();
+        }
+    }
+}
+
+// Whether class_i's words fit in ltrs, whose mask is ltrs_mask, and whose
+// letter_product is ltrs_product, or 0 to check letter counts instead
+template<class Counts>
+inline bool class_fits(const Counts & ltrs,
+                       const typename Counts::Mask ltrs_mask,
+                       const std::uint64_t ltrs_product,
+                       const std::uint32_t class_i,
+                       const Word_list<Counts> & dictionary,
+                       Search_stats & stats)
+{
+    if(collect_stats)
+        ++stats.tested;
+
+    if(dictionary.mask(class_i) & ~ltrs_mask)
+    {
+        if(collect_stats)
+            ++stats.mask_rejected;
+        return false;
+    }
+
+    if(ltrs_product)
+    {
+        // a word whose product overflowed can't divide one that didn't
+        if(dictionary.product(class_i) == 0 || ltrs_product % dictionary.product(class_i) != 0)
+        {
+            if(collect_stats)
+                ++stats.prime_rejected;
+            return false;
+        }
+    }
+    else if(!ltrs.contains(dictionary.ltrs(class_i)))
+    {
+        if(collect_stats)
+            ++stats.count_rejected;
+        return false;
+    }
+
+    return true;
+}
+
+// Finish memoizing a node whose search is complete, returning it
+template<class Counts>
+std::shared_ptr<const Memo_node> memoize(const Counts & ltrs,
+                                         const std::uint32_t first_class,
+                                         const std::shared_ptr<Memo_node> & node,
+                                         const Search_options & options,
+                                         Worker<Counts> & worker)
+{
+    // drop branches that lead nowhere
+    for(auto & edge: node->edges)
+    {
+        if(edge.child && edge.child->edges.empty())
+            edge.child = nullptr;
+    }
+    if(!options.show_partial)
+    {
+        node->edges.erase(std::remove_if(node->edges.begin(), node->edges.end(),
+                    [](const Memo_node::Edge & edge) { return !edge.full && !edge.child; }),
+                node->edges.end());
+    }
+
+    worker.memo->insert(ltrs, first_class, node, worker.stats);
+    return node;
+}
+
+// Start on the node with letters ltrs, whose candidates are [list_begin,
+// list_end) of worker.candidates: print the classes of words that fit, then
+// push a frame to search its branches. Returns false if it has no branches,
+// with the node's result for its parent in result: with memoization enabled,
+// the memoized node.
+//
+// Combinations are generated in canonical order: classes are sorted, and each
+// branch only considers candidates at or after its own position in its
+// parent's list, so every group of classes is produced exactly once, for
+// permutations too: output_anagrams puts each group's words in every order.
+template<class Counts>
+bool enter_node(const Counts & ltrs,
+                const std::size_t list_begin,
+                const std::size_t list_end,
+                const Word_list<Counts> & dictionary,
+                const Search_options & options,
+                Worker<Counts> & worker,
+                std::shared_ptr<const Memo_node> & result)
+{
+    result = nullptr;
+    if(ltrs.empty())
+        return false;
+
+    auto & stats = worker.stats;
+    auto & candidates = worker.candidates;
+
+    const auto depth = worker.prefix.size();
+    if(collect_stats)
+    {
+        if(depth >= stats.depths.size())
+            stats.depths.resize(depth + 1);
+        ++stats.depths[depth].nodes;
+    }
+
+    // a node's candidates are exactly the classes fitting ltrs, from the first
+    // class in its list
+    std::shared_ptr<Memo_node> node;
+    std::uint32_t first_class = 0;
+    if(worker.memo)
+    {
+        if(list_begin == list_end)
+        {
+            result = worker.memo->empty_node();
+            return false;
+        }
+
+        first_class = candidates[list_begin];
+        if(auto found = worker.memo->find(ltrs, first_class, stats))
+        {
+            output_memo(*found, dictionary, options, worker);
+            result = std::move(found);
+            return false;
+        }
+        node = worker.memo->make_node();
+    }
+
+    // when the remaining letters' product fits in 64 bits, it decides exactly
+    // whether a word fits, so the full count check can be skipped. Computing
+    // it and dividing is usually slower than the count check, so it's optional
+    const auto ltrs_mask = ltrs.mask();
+    const auto ltrs_product = options.prime_filter ? letter_product(ltrs, dictionary.alphabet()) : 0;
+
+    // this node's list of candidates, for its children
+    const auto new_list_begin = candidates.size();
+    if(collect_stats)
+        stats.depths[depth].tested += list_end - list_begin;
+
+    for(std::size_t i = list_begin; i < list_end; ++i)
+    {
+        const auto class_i = candidates[i];
+        if(!class_fits(ltrs, ltrs_mask, ltrs_product, class_i, dictionary, stats))
+            continue;
+
+        Counts word_ltrs;
+        ltrs.subtract_unchecked(dictionary.ltrs(class_i), word_ltrs);
+        bool full = word_ltrs.empty();
+
+        if(options.show_partial || full)
+        {
+            worker.prefix.push_back(class_i);
+            output_anagrams(dictionary, full, options, worker);
+            worker.prefix.pop_back();
+        }
+
+        candidates.push_back(class_i);
+        if(node)
+            node->edges.push_back(Memo_node::Edge{class_i, full, nullptr});
+    }
+
+    const auto new_list_end = candidates.size();
+    if(new_list_begin == new_list_end)
+    {
+        if(node)
+            result = memoize(ltrs, first_class, node, options, worker);
+        return false;
+    }
+
+    worker.stack.push_back(Search_frame<Counts>{ltrs, new_list_begin, new_list_end, new_list_begin, new_list_end,
+                                        true, false, nullptr, std::move(node), first_class});
+    return true;
+}
+
+// The lowest score of any full anagram under the node reached with the
+// classes in worker.prefix, with ltrs left and candidates from list_begin of
+// worker.candidates. Candidates must be longest first
+template<class Counts>
+int score_bound(const Counts & ltrs,
+                const std::size_t list_begin,
+                const Word_list<Counts> & dictionary,
+                const Search_options & options,
+                const Worker<Counts> & worker)
+{
+    const auto left = ltrs.total();
+    const auto longest_left = std::min(dictionary.ltrs(worker.candidates[list_begin]).total(), left);
+
+    if(options.score == Search_options::FEWEST_WORDS)
+        return static_cast<int>(worker.prefix.size() + (left + longest_left - 1) / longest_left);
+
+    std::size_t longest = longest_left;
+    for(auto class_i: worker.prefix)
+        longest = std::max(longest, dictionary.ltrs(class_i).total());
+    return -static_cast<int>(longest);
+}
+
+// Put candidates longest first when looking for the best anagrams, so good
+// ones are found early, and score_bound can find the longest that's left
+template<class Counts>
+void order_candidates(std::vector<std::uint32_t> & candidates,
+                      const Word_list<Counts> & dictionary,
+                      const Search_options & options)
+{
+    if(!options.best)
+        return;
+
+    std::stable_sort(candidates.begin(), candidates.end(), [&dictionary](std::uint32_t a, std::uint32_t b)
+    {
+        return dictionary.ltrs(a).total() > dictionary.ltrs(b).total();
+    });
+}
+
+// Print the best anagrams found, best first, and no more than options.best
+template<class Counts>
+void output_best(const Best_anagrams & best,
+                 const Word_list<Counts> & dictionary,
+                 const Search_options & options,
+                 Worker<Counts> & worker)
+{
+    auto print_options = options;
+    print_options.best = 0;
+    print_options.limit = options.best;
+    Search_shared print_shared(print_options);
+
+    auto shared = worker.shared;
+    worker.shared = &print_shared;
+    for(auto & entry: best.entries())
+    {
+        worker.prefix = entry.classes;
+        output_anagrams(dictionary, true, print_options, worker);
+    }
+    worker.prefix.clear();
+    worker.shared = shared;
+}
+
+// Pop the top frame of the worker's stack, once its branches are done,
+// returning the node's result for its parent
+template<class Counts>
+std::shared_ptr<const Memo_node> leave_node(const Search_options & options, Worker<Counts> & worker)
+{
+    auto & frame = worker.stack.back();
+
+    if(frame.continuation)
+        worker.pool->finish_segment(worker, frame.continuation);
+
+    // the node's list of candidates is at the end, and no longer needed
+    worker.candidates.resize(frame.list_begin);
+
+    std::shared_ptr<const Memo_node> result;
+    if(frame.node && frame.complete)
+        result = memoize(frame.ltrs, frame.first_class, frame.node, options, worker);
+
+    worker.stack.pop_back();
+    return result;
+}
+
+// Record the result of the top frame's current branch, and move on to its next
+template<class Counts>
+void finish_branch(std::shared_ptr<const Memo_node> child, Worker<Counts> & worker)
+{
+    auto & frame = worker.stack.back();
+    if(frame.node)
+    {
+        auto & edge = frame.node->edges[frame.branch - frame.list_begin];
+        if(!child && !edge.full)
+            frame.complete = false;
+        edge.child = std::move(child);
+    }
+
+    worker.prefix.pop_back();
+    ++frame.branch;
+}
+
+// A saved search, for --checkpoint and --resume: this header, then the
+// worker's candidates and prefix as uint32s, then a Checkpoint_frame for each
+// frame on its stack. A search that has finished saves an empty stack
+struct Checkpoint_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t letter_counts_size;
+    std::uint64_t key; // search_key of the search it was saved from
+    std::uint64_t output_size; // bytes of output written when it was saved
+    std::uint64_t full_found; // Search_shared::full_found
+    std::uint64_t full_anagrams;
+    std::uint64_t partial_anagrams;
+    std::uint64_t shard_part; // Worker::shard_part
+    std::uint64_t num_candidates;
+    std::uint64_t num_prefix;
+    std::uint64_t num_frames;
+};
+
+const char checkpoint_magic[8] = {'A', 'N', 'A', 'C', 'K', 'P', 'T', '\0'};
+const std::uint32_t checkpoint_version = 2;
+
+// nodes searched between looking at the clock, to see if a checkpoint is due
+const std::size_t checkpoint_check_nodes = 1024;
+
+// The part of a Search_frame that's saved. The rest is only needed by
+// memoizing and multi-threaded searches
+template<class Counts>
+struct Checkpoint_frame
+{
+    Counts ltrs;
+    std::uint64_t list_begin, list_end;
+    std::uint64_t branch, last;
+};
+
+// A hash of everything that decides what a search of ltrs prints, so a
+// checkpoint is only resumed by the same search
+template<class Counts>
+std::uint64_t search_key(const Counts & ltrs, const Word_list<Counts> & dictionary, const Search_options & options)
+{
+    std::string key(reinterpret_cast<const char *>(&ltrs), sizeof(ltrs));
+    const std::uint64_t values[] = {dictionary.words_checksum(), dictionary.num_classes(),
+                                    options.show_partial, options.permutations, options.count_only, options.limit,
+                                    options.shard, options.num_shards, options.max_words};
+    key.append(reinterpret_cast<const char *>(values), sizeof(values));
+    for(auto & word: options.include)
+        key += word + '\n';
+    return checksum(key.data(), key.size());
+}
+
+// Write the worker's output so far, then save its search to its checkpoint
+// file. Only for a single-threaded search, between its nodes. Throws
+// std::runtime_error on failure
+template<class Counts>
+void save_checkpoint(Worker<Counts> & worker)
+{
+    flush_output(worker);
+
+    Checkpoint_header header{};
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.letter_counts_size = sizeof(Counts);
+    header.key = worker.checkpoint_key;
+    auto position = ::lseek(worker.fd, 0, SEEK_CUR);
+    header.output_size = position < 0 ? 0 : position;
+    header.full_found = worker.shared->full_found.load();
+    header.full_anagrams = worker.stats.full_anagrams;
+    header.partial_anagrams = worker.stats.partial_anagrams;
+    header.shard_part = worker.shard_part;
+    header.num_candidates = worker.candidates.size();
+    header.num_prefix = worker.prefix.size();
+    header.num_frames = worker.stack.size();
+
+    std::vector<Checkpoint_frame<Counts>> frames;
+    frames.reserve(worker.stack.size());
+    for(auto & frame: worker.stack)
+        frames.push_back({frame.ltrs, frame.list_begin, frame.list_end, frame.branch, frame.last});
+
+    // as with write_index, a failed write never replaces the last checkpoint
+    auto & path = worker.checkpoint->path;
+    std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(worker.candidates.data()), worker.candidates.size() * sizeof(std::uint32_t));
+    file.write(reinterpret_cast<const char *>(worker.prefix.data()), worker.prefix.size() * sizeof(std::uint32_t));
+    file.write(reinterpret_cast<const char *>(frames.data()), frames.size() * sizeof(Checkpoint_frame<Counts>));
+    if(file)
+        file.close();
+
+    if(!file || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        auto err = errno;
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Error writing " + path + ": " + std::strerror(err));
+    }
+}
+
+// Save a checkpoint if one is due. Called from run_stack between nodes
+template<class Counts>
+void check_checkpoint(Worker<Counts> & worker)
+{
+    worker.checkpoint_countdown = checkpoint_check_nodes;
+    const auto now = std::chrono::steady_clock::now();
+    if(now < worker.next_checkpoint)
+        return;
+
+    save_checkpoint(worker);
+    worker.next_checkpoint = now + worker.checkpoint->interval;
+}
+
+// Restore the search saved in the worker's checkpoint file onto its stack,
+// and cut fd's output back to where it was when it was saved, so the search
+// carries on without repeating or missing any. dictionary is the view the
+// search uses. Throws std::runtime_error if the checkpoint can't be read, or is
+// from a different search
+template<class Counts>
+void load_checkpoint(const Word_list<Counts> & dictionary, const Search_options & options, Worker<Counts> & worker)
+{
+    auto & path = worker.checkpoint->path;
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+        throw std::runtime_error("Error opening " + path + ": " + std::strerror(errno));
+
+    Checkpoint_header header{};
+    if(!file.read(reinterpret_cast<char *>(&header), sizeof(header))
+            || std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0
+            || header.version != checkpoint_version
+            || header.letter_counts_size != sizeof(Counts))
+        throw std::runtime_error(path + " isn't a checkpoint, or is from a different version");
+    if(header.key != worker.checkpoint_key)
+        throw std::runtime_error(path + " was saved by a search with a different dictionary, input or options");
+
+    std::vector<Checkpoint_frame<Counts>> frames(header.num_frames);
+    worker.candidates.resize(header.num_candidates);
+    worker.prefix.resize(header.num_prefix);
+    file.read(reinterpret_cast<char *>(worker.candidates.data()), worker.candidates.size() * sizeof(std::uint32_t));
+    file.read(reinterpret_cast<char *>(worker.prefix.data()), worker.prefix.size() * sizeof(std::uint32_t));
+    file.read(reinterpret_cast<char *>(frames.data()), frames.size() * sizeof(Checkpoint_frame<Counts>));
+    if(!file || file.peek() != std::ifstream::traits_type::eof())
+        throw std::runtime_error(path + " is truncated or corrupt");
+
+    // the key matched, so this only guards against a damaged file
+    auto valid = worker.prefix.size() + 1 == std::max<std::size_t>(frames.size(), 1);
+    for(auto class_i: worker.candidates)
+        valid = valid && class_i < dictionary.num_classes();
+    for(auto class_i: worker.prefix)
+        valid = valid && class_i < dictionary.num_classes();
+    for(auto & frame: frames)
+    {
+        valid = valid && frame.list_begin <= frame.branch && frame.branch <= frame.last
+            && frame.last <= frame.list_end && frame.list_end <= worker.candidates.size();
+    }
+    if(!valid)
+        throw std::runtime_error(path + " is corrupt");
+
+    if(!options.count_only)
+    {
+        struct stat output_stat;
+        if(::fstat(worker.fd, &output_stat) != 0 || static_cast<std::uint64_t>(output_stat.st_size) < header.output_size)
+        {
+            throw std::runtime_error("The output has less in it than when " + path + " was saved. "
+                                     "Append to the same file (>>) to resume");
+        }
+        if(::ftruncate(worker.fd, header.output_size) != 0 || ::lseek(worker.fd, header.output_size, SEEK_SET) < 0)
+            throw std::runtime_error(std::string("Error truncating the output: ") + std::strerror(errno));
+    }
+
+    worker.shared->full_found = header.full_found;
+    worker.stats.full_anagrams = header.full_anagrams;
+    worker.stats.partial_anagrams = header.partial_anagrams;
+    worker.shard_part = header.shard_part;
+
+    // each level uses at least one letter. The frames aren't memoized, as
+    // their nodes' earlier branches were searched before the checkpoint
+    worker.stack.clear();
+    if(!frames.empty())
+        worker.stack.reserve(frames.front().ltrs.total() + 1);
+    for(auto & frame: frames)
+    {
+        worker.stack.push_back(Search_frame<Counts>{frame.ltrs, frame.list_begin, frame.list_end, frame.branch, frame.last,
+                                                    false, false, nullptr, nullptr, 0});
+    }
+}
+
+// Whether the node with ltrs left, under the classes in worker.prefix, can
+// print anything within --max-words: it has a word to spare, and unless
+// partial anagrams are wanted, few enough letters left to finish with the
+// words it has, if --max-word-len is set
+template<class Counts>
+bool within_max_words(const Counts & ltrs, const Search_options & options, const Worker<Counts> & worker)
+{
+    if(worker.prefix.size() >= options.max_words)
+        return false;
+    const auto words_left = options.max_words - worker.prefix.size();
+    const auto longest = options.filter.max_letters;
+    return options.show_partial || !longest || (ltrs.total() + longest - 1) / longest <= words_left;
+}
+
+// Search the branches of the frames on the worker's stack, depth first, until
+// the stack is back down to base frames. This is the search's main loop:
+// rather than recursing, each node searched pushes a frame, and pops it once
+// its branches are done, so the stack only allocates until it reaches the
+// deepest level the search has needed
+template<class Counts>
+void run_stack(const std::size_t base,
+               const Word_list<Counts> & dictionary,
+               const Search_options & options,
+               Worker<Counts> & worker)
+{
+    auto & stack = worker.stack;
+
+    while(stack.size() > base)
+    {
+        if(worker.checkpoint && --worker.checkpoint_countdown == 0)
+            check_checkpoint(worker);
+
+        auto & frame = stack.back();
+
+        if(frame.branch < frame.last && worker.shared->done(options))
+        {
+            frame.complete = false;
+            frame.last = frame.branch;
+        }
+
+        if(frame.branch == frame.last)
+        {
+            auto result = leave_node(options, worker);
+            if(stack.size() > base)
+                finish_branch(std::move(result), worker);
+            continue;
+        }
+
+        if(worker.pool && frame.last - frame.branch > 1 && worker.pool->hungry())
+        {
+            // keep the first half, so ordered output stays contiguous
+            auto mid = frame.branch + (frame.last - frame.branch + 1) / 2;
+            auto next = worker.pool->donate(worker, frame.ltrs, frame.list_begin, frame.list_end, mid, frame.last, !frame.donated);
+            if(!frame.donated)
+                frame.continuation = next;
+            frame.donated = true;
+            frame.complete = false;
+            frame.last = mid;
+        }
+
+        const auto class_i = worker.candidates[frame.branch];
+
+        Counts word_ltrs;
+        frame.ltrs.subtract_unchecked(dictionary.ltrs(class_i), word_ltrs);
+
+        const auto child_begin = frame.branch;
+
+        worker.prefix.push_back(class_i);
+        if(options.best && !word_ltrs.empty()
+                && worker.shared->best->rejects(score_bound(word_ltrs, child_begin, dictionary, options, worker)))
+        {
+            // nothing under this branch can make the best
+            if(collect_stats)
+                ++worker.stats.bound_pruned;
+            worker.prefix.pop_back();
+            frame.complete = false;
+            ++frame.branch;
+            continue;
+        }
+        if(!word_ltrs.empty() && !within_max_words(word_ltrs, options, worker))
+        {
+            worker.prefix.pop_back();
+            frame.complete = false;
+            ++frame.branch;
+            continue;
+        }
+
+        // frame may move once the child's frame is pushed
+        std::shared_ptr<const Memo_node> child;
+        if(enter_node(word_ltrs, child_begin, frame.list_end, dictionary, options, worker, child))
+            continue;
+
+        finish_branch(std::move(child), worker);
+    }
+}
+
+// Search the node with letters ltrs, whose candidates are [list_begin,
+// list_end) of worker.candidates
+template<class Counts>
+void search_node(const Counts & ltrs,
+                 const std::size_t list_begin,
+                 const std::size_t list_end,
+                 const Word_list<Counts> & dictionary,
+                 const Search_options & options,
+                 Worker<Counts> & worker)
+{
+    // each level uses at least one letter
+    worker.stack.reserve(worker.stack.size() + ltrs.total() + 1);
+
+    const auto base = worker.stack.size();
+    std::shared_ptr<const Memo_node> result;
+    if(enter_node(ltrs, list_begin, list_end, dictionary, options, worker, result))
+        run_stack(base, dictionary, options, worker);
+}
+
+// A part of a sharded search: the root's branches [first, last), or, when
+// split, only the branches [child_first, child_last) of the root's branch first
+struct Shard_part
+{
+    std::size_t first, last;
+    bool split;
+    std::size_t child_first, child_last;
+};
+
+// probes per node in shard_cost
+const std::size_t shard_probes = 64;
+
+// An estimate of the classes tested by the search under the node with letters
+// ltrs, whose candidates are [list_begin, list_end) of candidates, from
+// Knuth's method as in estimate_search. Everything is in integers, saturating,
+// and drawn from rng by the same steps in every process, so every shard works
+// out the same cost
+template<class Counts>
+std::uint64_t shard_cost(const Counts & ltrs,
+                         const std::size_t list_begin,
+                         const std::size_t list_end,
+                         const Word_list<Counts> & dictionary,
+                         std::vector<std::uint32_t> & candidates,
+                         std::vector<std::size_t> & branches,
+                         std::mt19937_64 & rng)
+{
+    const auto saturate = [](std::uint64_t a, std::uint64_t b, bool multiply)
+    {
+        std::uint64_t r;
+        return (multiply ? __builtin_mul_overflow(a, b, &r) : __builtin_add_overflow(a, b, &r))
+            ? std::numeric_limits<std::uint64_t>::max() : r;
+    };
+
+    Search_stats stats;
+    const auto base = candidates.size();
+    std::uint64_t total = 0;
+    for(std::size_t probe = 0; probe < shard_probes; ++probe)
+    {
+        Counts node_ltrs = ltrs;
+        std::size_t begin = list_begin, end = list_end;
+        std::uint64_t weight = 1, tested = 0;
+        while(!node_ltrs.empty())
+        {
+            tested = saturate(tested, saturate(weight, end - begin, true), false);
+
+            const auto mask = node_ltrs.mask();
+            const auto left = node_ltrs.total();
+            branches.clear();
+            for(std::size_t i = begin; i < end; ++i)
+            {
+                const auto class_i = candidates[i];
+                if(!class_fits(node_ltrs, mask, 0, class_i, dictionary, stats))
+                    continue;
+                if(dictionary.ltrs(class_i).total() < left)
+                    branches.push_back(candidates.size());
+                candidates.push_back(class_i);
+            }
+            if(branches.empty())
+                break;
+
+            const auto branch = branches[rng() % branches.size()];
+            weight = saturate(weight, branches.size(), true);
+            Counts word_ltrs;
+            node_ltrs.subtract_unchecked(dictionary.ltrs(candidates[branch]), word_ltrs);
+            node_ltrs = word_ltrs;
+            begin = branch;
+            end = candidates.size();
+        }
+        candidates.resize(base);
+        total = saturate(total, tested, false);
+    }
+    return total / shard_probes;
+}
+
+// The parts of the search that shard options.shard of options.num_shards
+// searches, in order. The root's branches, and the branches of any of them
+// costing more than a shard's share, are split into num_shards contiguous
+// ranges of about the same cost by shard_cost, so the shards take about as
+// long as each other, and their output, one after another, is the whole
+// search's. dictionary must be pruned to ltrs
+template<class Counts>
+std::vector<Shard_part> shard_parts(const Counts & ltrs,
+                                    const Word_list<Counts> & dictionary,
+                                    const Search_options & options)
+{
+    const auto n = dictionary.num_classes();
+    std::vector<std::uint32_t> candidates(n);
+    std::iota(candidates.begin(), candidates.end(), 0);
+    std::vector<std::size_t> branches;
+    std::mt19937_64 rng; // fixed seed, so every shard agrees
+    Search_stats stats;
+
+    // every class fits the root, so its branches are the classes themselves
+    std::vector<std::uint64_t> costs(n);
+    std::uint64_t total = 0;
+    for(std::size_t b = 0; b < n; ++b)
+    {
+        Counts word_ltrs;
+        ltrs.subtract_unchecked(dictionary.ltrs(b), word_ltrs);
+        costs[b] = shard_cost(word_ltrs, b, n, dictionary, candidates, branches, rng);
+        total += std::min(costs[b], std::numeric_limits<std::uint64_t>::max() - total);
+    }
+
+    // the search in units, in the order it searches them: whole branches of
+    // the root, or the branches of a root branch's node, for those that cost
+    // more than a shard's share
+    struct Unit
+    {
+        std::size_t branch;
+        bool split;
+        std::size_t child;
+        std::uint64_t cost;
+    };
+    std::vector<Unit> units;
+    for(std::size_t b = 0; b < n; ++b)
+    {
+        Counts word_ltrs;
+        ltrs.subtract_unchecked(dictionary.ltrs(b), word_ltrs);
+        if(costs[b] <= total / options.num_shards || word_ltrs.empty())
+        {
+            units.push_back(Unit{b, false, 0, costs[b]});
+            continue;
+        }
+
+        const auto mask = word_ltrs.mask();
+        for(std::size_t i = b; i < n; ++i)
+        {
+            if(class_fits(word_ltrs, mask, 0, i, dictionary, stats))
+                candidates.push_back(i);
+        }
+        const auto list_end = candidates.size();
+        for(auto k = n; k < list_end; ++k)
+        {
+            Counts child_ltrs;
+            word_ltrs.subtract_unchecked(dictionary.ltrs(candidates[k]), child_ltrs);
+            units.push_back(Unit{b, true, k - n, shard_cost(child_ltrs, k, list_end, dictionary, candidates, branches, rng)});
+        }
+        candidates.resize(n);
+    }
+
+    // shard s starts at the first unit with at least s / num_shards of the
+    // total cost before it
+    std::vector<std::uint64_t> ends(units.size() + 1);
+    for(std::size_t u = 0; u < units.size(); ++u)
+        ends[u + 1] = ends[u] + std::min(units[u].cost, std::numeric_limits<std::uint64_t>::max() - ends[u]);
+    const auto num_shards = options.num_shards;
+    auto boundary = [&](const std::size_t s) -> std::size_t
+    {
+        if(s == num_shards)
+            return units.size();
+        // ceil(ends.back() * s / num_shards), without overflowing
+        const auto q = ends.back() / num_shards, r = ends.back() % num_shards;
+        const auto target = q * s + (r * s + num_shards - 1) / num_shards;
+        return std::lower_bound(ends.begin(), ends.end() - 1, target) - ends.begin();
+    };
+
+    // join the shard's consecutive units of the same kind into parts
+    std::vector<Shard_part> parts;
+    const auto end = boundary(options.shard + 1);
+    for(auto u = boundary(options.shard); u < end; ++u)
+    {
+        auto & unit = units[u];
+        if(!parts.empty() && !parts.back().split && !unit.split)
+            parts.back().last = unit.branch + 1;
+        else if(!parts.empty() && parts.back().split && unit.split && parts.back().first == unit.branch)
+            parts.back().child_last = unit.child + 1;
+        else
+            parts.push_back(Shard_part{unit.branch, unit.branch + 1, unit.split, unit.child, unit.child + 1});
+    }
+    return parts;
+}
+
+// Push a frame for the node with letters ltrs and candidates [list_begin,
+// list_end), as enter_node does, but to search only its branches [first,
+// last), as positions in its list. Its own anagrams are only printed if own.
+// Returns false if it has no branches
+template<class Counts>
+bool enter_part(const Counts & ltrs,
+                const std::size_t list_begin,
+                const std::size_t list_end,
+                const std::size_t first,
+                const std::size_t last,
+                const bool own,
+                const Word_list<Counts> & dictionary,
+                const Search_options & options,
+                Worker<Counts> & worker)
+{
+    auto & candidates = worker.candidates;
+    if(own)
+    {
+        std::shared_ptr<const Memo_node> result;
+        if(!enter_node(ltrs, list_begin, list_end, dictionary, options, worker, result))
+            return false;
+    }
+    else
+    {
+        const auto new_list_begin = candidates.size();
+        const auto ltrs_mask = ltrs.mask();
+        for(std::size_t i = list_begin; i < list_end; ++i)
+        {
+            const auto class_i = candidates[i];
+            if(class_fits(ltrs, ltrs_mask, 0, class_i, dictionary, worker.stats))
+                candidates.push_back(class_i);
+        }
+        if(ltrs.empty() || new_list_begin == candidates.size())
+            return false;
+        worker.stack.push_back(Search_frame<Counts>{ltrs, new_list_begin, candidates.size(), 0, 0,
+                                                    true, false, nullptr, nullptr, 0});
+    }
+
+    auto & frame = worker.stack.back();
+    frame.branch = frame.list_begin + first;
+    frame.last = frame.list_begin + last;
+    frame.complete = false;
+    return true;
+}
+
+// Search options' shard of the search from the root, a part at a time, from
+// part first_part on. Each node's own anagrams are printed by the part that
+// starts at its first branch
+template<class Counts>
+void search_shard(const Counts & ltrs,
+                  const std::size_t first_part,
+                  const Word_list<Counts> & dictionary,
+                  const Search_options & options,
+                  Worker<Counts> & worker)
+{
+    const auto n = dictionary.num_classes();
+    const auto parts = shard_parts(ltrs, dictionary, options);
+    for(worker.shard_part = first_part; worker.shard_part < parts.size(); ++worker.shard_part)
+    {
+        auto & part = parts[worker.shard_part];
+        worker.candidates.resize(n);
+        std::iota(worker.candidates.begin(), worker.candidates.end(), 0);
+        worker.stack.reserve(ltrs.total() + 1);
+
+        const bool own_root = part.first == 0 && (!part.split || part.child_first == 0);
+        if(!enter_part(ltrs, 0, n, part.first, part.last, own_root, dictionary, options, worker))
+            continue;
+
+        if(part.split)
+        {
+            auto & frame = worker.stack.back();
+            const auto class_i = worker.candidates[frame.branch];
+            Counts word_ltrs;
+            ltrs.subtract_unchecked(dictionary.ltrs(class_i), word_ltrs);
+            worker.prefix.push_back(class_i);
+            if(!within_max_words(word_ltrs, options, worker)
+                    || !enter_part(word_ltrs, frame.branch, frame.list_end, part.child_first, part.child_last,
+                                   part.child_first == 0, dictionary, options, worker))
+                finish_branch(nullptr, worker);
+        }
+        run_stack(0, dictionary, options, worker);
+    }
+}
+
+// Search from the root, with every class in the dictionary as a candidate, or
+// only options' shard of that search. dictionary must be pruned to ltrs
+template<class Counts>
+void search_dictionary(const Counts & ltrs,
+                       const Word_list<Counts> & dictionary,
+                       const Search_options & options,
+                       Worker<Counts> & worker)
+{
+    // the included words on their own are a full anagram if they took every
+    // letter, and otherwise a partial one
+    if(!options.include.empty() && options.shard == 0 && (ltrs.empty() || options.show_partial))
+        output_anagrams(dictionary, ltrs.empty(), options, worker);
+    if(ltrs.empty() || options.max_words == 0)
+        return;
+
+    if(options.num_shards > 1)
+    {
+        search_shard(ltrs, 0, dictionary, options, worker);
+        return;
+    }
+
+    worker.candidates.resize(dictionary.num_classes());
+    std::iota(worker.candidates.begin(), worker.candidates.end(), 0);
+    order_candidates(worker.candidates, dictionary, options);
+    search_node(ltrs, 0, dictionary.num_classes(), dictionary, options, worker);
+}
+
+// Predictions of the size of a search, from estimate_search
+struct Search_estimate
+{
+    double anagrams = 0; // lines a full search would print
+    double anagrams_error = 0; // standard error of anagrams
+    double tested = 0; // classes a full search would test for fit
+    double seconds = 0; // time a full single-threaded search would take, not counting output
+};
+
+// Estimate the size of a search with Knuth's method: each probe follows one
+// random path down from the root, choosing uniformly between a node's
+// branches, and weights what it finds at each node by the product of the
+// numbers of branches above it. The mean over the probes is an unbiased
+// estimate of the search's totals, searching the same pruned dictionary as
+// run_search
+template<class Counts>
+Search_estimate estimate_search(const Counts & ltrs,
+                                const Word_list<Counts> & full_dictionary,
+                                const Search_options & options,
+                                const std::size_t probes)
+{
+    Worker<Counts> worker;
+    worker.view.prune(full_dictionary, ltrs, options.filter);
+    const auto & dictionary = worker.view;
+    auto & candidates = worker.candidates;
+    std::vector<std::size_t> branches; // positions in candidates of the current node's branches
+    std::mt19937_64 rng; // fixed seed, so estimates are repeatable
+
+    double sum = 0, sum_squares = 0, tested = 0;
+    std::uint64_t probes_tested = 0; // classes the probes themselves tested
+    const auto start = std::chrono::steady_clock::now();
+
+    for(std::size_t probe = 0; probe < probes; ++probe)
+    {
+        candidates.resize(dictionary.num_classes());
+        std::iota(candidates.begin(), candidates.end(), 0);
+        worker.prefix.clear();
+
+        Counts node_ltrs = ltrs;
+        std::size_t list_begin = 0;
+        std::size_t list_end = candidates.size();
+        double weight = 1, found = 0;
+
+        while(!node_ltrs.empty() && worker.prefix.size() < options.max_words)
+        {
+            tested += weight * (list_end - list_begin);
+            probes_tested += list_end - list_begin;
+
+            const auto ltrs_mask = node_ltrs.mask();
+            const auto ltrs_product = options.prime_filter ? letter_product(node_ltrs, dictionary.alphabet()) : 0;
+            branches.clear();
+
+            for(std::size_t i = list_begin; i < list_end; ++i)
+            {
+                const auto class_i = candidates[i];
+                if(!class_fits(node_ltrs, ltrs_mask, ltrs_product, class_i, dictionary, worker.stats))
+                    continue;
+
+                Counts word_ltrs;
+                node_ltrs.subtract_unchecked(dictionary.ltrs(class_i), word_ltrs);
+                bool full = word_ltrs.empty();
+
+                if(options.show_partial || full)
+                {
+                    worker.prefix.push_back(class_i);
+                    found += weight * count_anagrams(dictionary, worker.prefix, options);
+                    worker.prefix.pop_back();
+                }
+
+                if(!full)
+                    branches.push_back(candidates.size());
+                candidates.push_back(class_i);
+            }
+
+            if(branches.empty())
+                break;
+
+            const auto branch = branches[std::uniform_int_distribution<std::size_t>(0, branches.size() - 1)(rng)];
+            weight *= branches.size();
+
+            const auto class_i = candidates[branch];
+            worker.prefix.push_back(class_i);
+            Counts word_ltrs;
+            node_ltrs.subtract_unchecked(dictionary.ltrs(class_i), word_ltrs);
+            node_ltrs = word_ltrs;
+
+            list_begin = branch;
+            list_end = candidates.size();
+        }
+
+        sum += found;
+        sum_squares += found * found;
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    Search_estimate estimate;
+    if(probes == 0)
+        return estimate;
+
+    estimate.anagrams = sum / probes;
+    if(probes > 1)
+        estimate.anagrams_error = std::sqrt(std::max(0.0, sum_squares - sum * estimate.anagrams) / (probes - 1) / probes);
+    estimate.tested = tested / probes;
+    if(probes_tested)
+        estimate.seconds = elapsed.count() / probes_tested * estimate.tested;
+
+    return estimate;
+}
+
+template<class Counts>
+void Work_pool<Counts>::run(const Counts & ltrs)
+{
+    if(ordered_)
+        head_ = new Output_segment;
+    busy_ = 1; // the root search, started by thread 0
+
+    std::vector<std::thread> threads;
+    for(std::size_t i = 1; i < num_threads_; ++i)
+        threads.emplace_back(&Work_pool::work, this, i, nullptr);
+
+    work(0, &ltrs);
+
+    for(auto & t: threads)
+        t.join();
+}
+
+template<class Counts>
+void Work_pool<Counts>::work(const std::size_t id, const Counts * ltrs)
+{
+    Worker<Counts> worker;
+    worker.pool = this;
+    worker.shared = &shared_;
+    worker.id = id;
+    worker.fd = fd_;
+    if(options_.memo_bytes)
+        worker.memo.reset(new Memo_cache<Counts>(options_.memo_bytes / num_threads_));
+
+    if(ltrs)
+    {
+        worker.segment = head_;
+        search_dictionary(*ltrs, dictionary_, options_, worker);
+        if(ordered_)
+            finish_segment(worker, nullptr);
+    }
+
+    Task task;
+    bool finished = ltrs != nullptr;
+    while(next_task(id, task, finished))
+    {
+        worker.segment = task.segment;
+        worker.prefix = std::move(task.prefix);
+        worker.candidates = std::move(task.candidates);
+        auto list_end = worker.candidates.size();
+        worker.stack.reserve(task.ltrs.total() + 1);
+        worker.stack.push_back(Search_frame<Counts>{task.ltrs, 0, list_end, task.first, task.last,
+                                            true, false, nullptr, nullptr, 0});
+        run_stack(0, dictionary_, options_, worker);
+        if(ordered_)
+            finish_segment(worker, nullptr);
+        finished = true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    {
+        Stats_timer timer(worker.stats.output_seconds);
+        write_output(fd_, worker.buffer);
+    }
+    stats_ += worker.stats;
+}
+
+void print_stats(std::ostream & out, const Search_stats & stats, const double load_seconds)
+{
+    auto rejected = stats.mask_rejected + stats.prime_rejected + stats.count_rejected;
+    auto prefilter_rejected = stats.mask_rejected + stats.prime_rejected;
+
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+
+    std::ostringstream depths;
+    for(std::size_t i = 0; i < stats.depths.size(); ++i)
+    {
+        depths<<(i ? ",\n" : "")
+              <<"    {\"nodes\": "<<stats.depths[i].nodes<<", \"tested\": "<<stats.depths[i].tested<<"}";
+    }
+
+    out<<"{\n"
+       <<"  \"prefilter\": {\n"
+       <<"    \"tested\": "<<stats.tested<<",\n"
+       <<"    \"accepted\": "<<stats.tested - rejected<<",\n"
+       <<"    \"mask_rejected\": "<<stats.mask_rejected<<",\n"
+       <<"    \"prime_rejected\": "<<stats.prime_rejected<<",\n"
+       <<"    \"count_rejected\": "<<stats.count_rejected<<",\n"
+       <<"    \"hit_rate\": "<<(rejected ? double(prefilter_rejected) / rejected : 0.0)<<",\n"
+       <<"    \"bound_pruned\": "<<stats.bound_pruned<<"\n"
+       <<"  },\n"
+       <<"  \"pruning\": {\n"
+       <<"    \"classes_kept\": "<<stats.classes_kept<<",\n"
+       <<"    \"classes_removed\": "<<stats.classes_removed<<",\n"
+       <<"    \"words_kept\": "<<stats.words_kept<<",\n"
+       <<"    \"words_removed\": "<<stats.words_removed<<"\n"
+       <<"  },\n"
+       <<"  \"depths\": [\n"<<depths.str()<<"\n  ],\n"
+       <<"  \"anagrams\": {\n"
+       <<"    \"full\": "<<stats.full_anagrams<<",\n"
+       <<"    \"partial\": "<<stats.partial_anagrams<<"\n"
+       <<"  },\n"
+       <<"  \"memo\": {\n"
+       <<"    \"hits\": "<<stats.memo_hits<<",\n"
+       <<"    \"misses\": "<<stats.memo_misses<<",\n"
+       <<"    \"evictions\": "<<stats.memo_evictions<<",\n"
+       <<"    \"peak_bytes\": "<<stats.memo_peak_bytes<<"\n"
+       <<"  },\n"
+       <<"  \"seconds\": {\n"
+       <<"    \"load\": "<<load_seconds<<",\n"
+       <<"    \"search\": "<<stats.search_seconds<<",\n"
+       <<"    \"output\": "<<stats.output_seconds<<"\n"
+       <<"  },\n"
+       <<"  \"allocations\": "<<(count_allocations ? std::to_string(stats.allocations) : "null")<<",\n"
+       // ru_maxrss is in KiB on Linux
+       <<"  \"peak_rss_bytes\": "<<std::uint64_t(usage.ru_maxrss) * 1024<<"\n"
+       <<"}"<<std::endl;
+}
+
+// run f(0) to f(n - 1), each on its own thread, with f(0) on this one
+template<class F>
+void parallel_for(const std::size_t n, F f)
+{
+    std::vector<std::thread> threads;
+    for(std::size_t i = 1; i < n; ++i)
+        threads.emplace_back(f, i);
+    if(n > 0)
+        f(0);
+    for(auto & t: threads)
+        t.join();
+}
+
+// map a file into memory privately, so it can be changed in place without
+// changing the file, or read it if it can't be mapped (a pipe, say). Throws
+// std::runtime_error on failure
+std::shared_ptr<char> load_file(const std::string & filename, std::size_t & size)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Error opening " + filename + ": " + std::strerror(errno));
+
+    struct stat st;
+    if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size = st.st_size;
+        auto data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            ::close(fd);
+            return std::shared_ptr<char>(static_cast<char *>(data), [size](char * p) { ::munmap(p, size); });
+        }
+    }
+
+    auto text = std::make_shared<std::string>(1 << 16, '\0');
+    size = 0;
+    while(true)
+    {
+        if(size == text->size())
+            text->resize(text->size() * 2);
+
+        auto got = ::read(fd, &(*text)[size], text->size() - size);
+        if(got < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            auto error = errno;
+            ::close(fd);
+            throw std::runtime_error("Error reading " + filename + ": " + std::strerror(error));
+        }
+        if(got == 0)
+            break;
+        size += got;
+    }
+    ::close(fd);
+    return std::shared_ptr<char>(text, &(*text)[0]);
+}
+
+// upper-case 16 bytes of ASCII text in place, and set bit i of newlines if
+// byte i is a newline, and of illegal if it can't be in a word
+void classify_ascii(char * text, const bool use_apostrophe, std::uint32_t & newlines, std::uint32_t & illegal)
+{
+#if defined(__SSE2__)
+    auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text));
+    auto lower = _mm_and_si128(_mm_cmpgt_epi8(a, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(a, _mm_set1_epi8('z' + 1)));
+    if(_mm_movemask_epi8(lower))
+    {
+        a = _mm_sub_epi8(a, _mm_and_si128(lower, _mm_set1_epi8('a' - 'A')));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(text), a);
+    }
+
+    auto newline = _mm_cmpeq_epi8(a, _mm_set1_epi8('\n'));
+    auto legal = _mm_or_si128(newline, _mm_and_si128(_mm_cmpgt_epi8(a, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(a, _mm_set1_epi8('Z' + 1))));
+    if(use_apostrophe)
+        legal = _mm_or_si128(legal, _mm_cmpeq_epi8(a, _mm_set1_epi8('\'')));
+
+    newlines = _mm_movemask_epi8(newline);
+    illegal = ~_mm_movemask_epi8(legal) & 0xFFFF;
+#else
+    newlines = illegal = 0;
+    for(int i = 0; i < 16; ++i)
+    {
+        char & c = text[i];
+        if(c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        if(c == '\n')
+            newlines |= 1u << i;
+        else if((!use_apostrophe || c != '\'') && (c < 'A' || c > 'Z'))
+            illegal |= 1u << i;
+    }
+#endif
+}
+
+// find the words in text[begin, end), which starts at the start of a line and
+// ends at the end of one, upper-casing them in place
+std::vector<Text_span> scan_words(char * text, const std::size_t begin, const std::size_t end, const std::uint32_t flags)
+{
+    const bool use_apostrophe = !(flags & NO_APOSTROPHE);
+    const bool restrict_small_words = flags & SMALL_WORDS;
+    const bool unicode = flags & UNICODE_ALPHABET;
+
+    static const std::unordered_set<std::string> legal_small_words
+    {
+        "A", "I",
+        "AH", "AM", "AN", "AS", "AT", "BE", "BY", "DC", "DO",
+        "DR", "EX", "GO", "HA", "HE", "HI", "HO", "IF", "II",
+        "IN", "IS", "IT", "LA", "LO", "MA", "ME", "MR", "MS",
+        "MY", "NO", "OF", "OH", "OK", "ON", "OR", "OW", "OX",
+        "PA", "PI", "SO", "ST", "TO",
+        "UP", "US", "WE"
+    };
+
+    std::vector<Text_span> words;
+    auto add_word = [&](const std::size_t word_begin, const std::size_t word_end)
+    {
+        const auto size = word_end - word_begin;
+        // small words are counted in characters, not UTF-8 bytes
+        auto small = [&]()
+        {
+            if(!unicode)
+                return size <= 2;
+            std::size_t chars = 0;
+            for(auto i = word_begin; i < word_end && chars <= 2; ++i)
+                chars += (static_cast<unsigned char>(text[i]) & 0xC0) != 0x80;
+            return chars <= 2;
+        };
+        if(size > 0 && (!restrict_small_words || !small() || legal_small_words.count(std::string(text + word_begin, size))))
+            words.push_back(Text_span{static_cast<std::uint32_t>(word_begin), static_cast<std::uint32_t>(size)});
+    };
+
+    if(!unicode)
+    {
+        // classify 16 bytes at a time, then step through the newlines among them
+        std::size_t line_begin = begin;
+        bool line_illegal = false;
+        for(std::size_t i = begin; i < end; i += 16)
+        {
+            std::uint32_t newlines, illegal;
+            if(end - i >= 16)
+                classify_ascii(text + i, use_apostrophe, newlines, illegal);
+            else
+            {
+                char block[16] = {};
+                const auto size = end - i;
+                std::memcpy(block, text + i, size);
+                classify_ascii(block, use_apostrophe, newlines, illegal);
+                std::memcpy(text + i, block, size);
+                newlines &= (1u << size) - 1;
+                illegal &= (1u << size) - 1;
+            }
+
+            while(newlines)
+            {
+                const auto bit = __builtin_ctz(newlines);
+                const std::uint32_t line_bits = (2u << bit) - 1;
+                if(!line_illegal && !(illegal & line_bits))
+                    add_word(line_begin, i + bit);
+
+                line_begin = i + bit + 1;
+                line_illegal = false;
+                illegal &= ~line_bits;
+                newlines &= newlines - 1;
+            }
+            line_illegal |= illegal != 0;
+        }
+        if(!line_illegal)
+            add_word(line_begin, end);
+    }
+    else
+    {
+        std::string upper;
+        for(std::size_t line_begin = begin; line_begin < end;)
+        {
+            auto line_end = static_cast<const char *>(std::memchr(text + line_begin, '\n', end - line_begin));
+            const std::size_t word_end = line_end ? line_end - text : end;
+
+            // upper_case never changes the length of a letter in UTF-8
+            bool skip_word = false;
+            for(auto i = line_begin; i < word_end && !skip_word;)
+            {
+                const auto letter_begin = i;
+                const auto c = upper_case(decode_utf8(text, word_end, i));
+                if(is_apostrophe(c) ? !use_apostrophe : !is_letter(c))
+                    skip_word = true;
+                else
+                {
+                    upper.clear();
+                    append_utf8(c, upper);
+                    std::copy(upper.begin(), upper.end(), text + letter_begin);
+                }
+            }
+
+            if(!skip_word)
+                add_word(line_begin, word_end);
+            line_begin = word_end + 1;
+        }
+    }
+
+    return words;
+}
+
+// A dictionary file's words, upper-cased, sorted and without duplicates, and
+// the alphabet they're written in
+struct Dictionary_words
+{
+    std::shared_ptr<char> text; // the file's contents, upper-cased in place
+    std::size_t text_size;
+    std::vector<Text_span> words; // spans of text
+    Alphabet alphabet;
+};
+
+// read words from a dictionary file, one per line, keeping those that are
+// only letters and apostrophes. With UNICODE_ALPHABET in flags, words are
+// UTF-8, and the alphabet is made of the letters they use. Large files are
+// split between num_threads threads. Throws std::runtime_error on failure
+Dictionary_words read_words(const std::string & dictionary_filename, const std::uint32_t flags, const std::size_t num_threads)
+{
+    // words are upper-cased in place, and kept as spans of the file's text,
+    // rather than each in its own string
+    std::size_t text_size = 0;
+    auto text = load_file(dictionary_filename, text_size);
+    if(text_size > std::numeric_limits<std::uint32_t>::max())
+        throw std::runtime_error(dictionary_filename + " is too large");
+
+    // split the text at line breaks into a chunk per thread, unless that would
+    // make the chunks too small to be worth it
+    const std::size_t min_chunk_size = 1 << 20;
+    const auto num_chunks = std::max(std::size_t(1), std::min(num_threads, text_size / min_chunk_size));
+    std::vector<std::size_t> chunk_begins{0};
+    for(std::size_t i = 1; i < num_chunks; ++i)
+    {
+        auto begin = std::max(text_size / num_chunks * i, chunk_begins.back());
+        auto newline = static_cast<const char *>(std::memchr(text.get() + begin, '\n', text_size - begin));
+        chunk_begins.push_back(newline ? newline - text.get() + 1 : text_size);
+    }
+    chunk_begins.push_back(text_size);
+
+    const char * t = text.get();
+    auto word_less = [t](const Text_span & a, const Text_span & b)
+    {
+        auto cmp = std::memcmp(t + a.offset, t + b.offset, std::min(a.size, b.size));
+        return cmp < 0 || (cmp == 0 && a.size < b.size);
+    };
+    auto word_equal = [t](const Text_span & a, const Text_span & b)
+    {
+        return a.size == b.size && std::memcmp(t + a.offset, t + b.offset, a.size) == 0;
+    };
+
+    // each thread sorts its own chunk's words and removes their duplicates
+    std::vector<std::vector<Text_span>> chunk_words(num_chunks);
+    parallel_for(num_chunks, [&](const std::size_t i)
+    {
+        auto & words = chunk_words[i];
+        words = scan_words(text.get(), chunk_begins[i], chunk_begins[i + 1], flags);
+        std::sort(words.begin(), words.end(), word_less);
+        words.erase(std::unique(words.begin(), words.end(), word_equal), words.end());
+    });
+
+    // then the chunks are merged in pairs, a pair per thread, and the
+    // duplicates between them removed
+    std::vector<Text_span> words;
+    std::vector<std::size_t> run_begins{0};
+    for(auto & chunk: chunk_words)
+    {
+        words.insert(words.end(), chunk.begin(), chunk.end());
+        run_begins.push_back(words.size());
+        std::vector<Text_span>().swap(chunk);
+    }
+
+    while(run_begins.size() > 2)
+    {
+        const auto num_runs = run_begins.size() - 1;
+        parallel_for(num_runs / 2, [&](const std::size_t i)
+        {
+            std::inplace_merge(words.begin() + run_begins[2 * i], words.begin() + run_begins[2 * i + 1],
+                               words.begin() + run_begins[2 * i + 2], word_less);
+        });
+
+        std::vector<std::size_t> merged_begins;
+        for(std::size_t i = 0; i < run_begins.size(); i += 2)
+            merged_begins.push_back(run_begins[i]);
+        if(num_runs % 2 == 1)
+            merged_begins.push_back(run_begins.back());
+        run_begins.swap(merged_begins);
+    }
+    words.erase(std::unique(words.begin(), words.end(), word_equal), words.end());
+
+    Alphabet alphabet;
+    if(flags & UNICODE_ALPHABET)
+    {
+        // most common letters first, so they get the smallest primes
+        std::vector<std::unordered_map<char32_t, std::uint64_t>> chunk_counts(num_chunks);
+        parallel_for(num_chunks, [&](const std::size_t chunk)
+        {
+            for(auto w = words.size() * chunk / num_chunks; w < words.size() * (chunk + 1) / num_chunks; ++w)
+            {
+                const auto & word = words[w];
+                for(std::size_t i = word.offset; i < word.offset + word.size;)
+                {
+                    const auto c = decode_utf8(t, word.offset + word.size, i);
+                    if(!is_apostrophe(c))
+                        ++chunk_counts[chunk][c];
+                }
+            }
+        });
+
+        std::unordered_map<char32_t, std::uint64_t> letter_counts;
+        for(auto & counts: chunk_counts)
+        {
+            for(auto & count: counts)
+                letter_counts[count.first] += count.second;
+        }
+
+        std::vector<std::pair<std::uint64_t, char32_t>> by_count;
+        for(auto & count: letter_counts)
+            by_count.emplace_back(count.second, count.first);
+        std::sort(by_count.begin(), by_count.end(), [](const std::pair<std::uint64_t, char32_t> & a, const std::pair<std::uint64_t, char32_t> & b)
+        {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+
+        if(by_count.empty())
+            throw std::runtime_error(dictionary_filename + " has no letters");
+        if(by_count.size() > Wide_letter_counts::slots)
+        {
+            throw std::runtime_error(dictionary_filename + " has " + std::to_string(by_count.size()) + " different letters (max "
+                    + std::to_string(Wide_letter_counts::slots) + ")");
+        }
+
+        std::vector<char32_t> letters;
+        for(auto & count: by_count)
+            letters.push_back(count.second);
+        alphabet = Alphabet(std::move(letters));
+    }
+
+    return Dictionary_words{std::move(text), text_size, std::move(words), std::move(alphabet)};
+}
+
+// The size of Letter_counts that an index file was built with, or 0 if it
+// can't be read
+std::size_t index_letter_counts_size(const std::string & path)
+{
+    Index_header header{};
+    std::ifstream file(path, std::ios::binary);
+    if(!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return 0;
+    return header.letter_counts_size;
+}
+
+// Build a Word_list of the words that fit in a Counts, with a Letter_trie if
+// with_trie
+template<class Counts>
+Word_list<Counts> make_word_list(const Dictionary_words & words,
+                                 const std::uint32_t flags,
+                                 const std::string & dictionary_filename,
+                                 const bool with_trie)
+{
+    std::vector<Text_span> fit_words;
+    std::vector<Counts> fit_ltrs;
+    fit_words.reserve(words.words.size());
+    fit_ltrs.reserve(words.words.size());
+    for(auto & word: words.words)
+    {
+        Counts word_ltrs;
+        if(count_letters(words.text.get() + word.offset, word.size, words.alphabet, word_ltrs))
+        {
+            fit_words.push_back(word);
+            fit_ltrs.push_back(word_ltrs);
+        }
+    }
+
+    return Word_list<Counts>(words.text.get(), fit_words, fit_ltrs, words.alphabet, flags, dictionary_filename, with_trie);
+}
+
+// read words from a dictionary file, one per line, into a Word_list, with
+// num_threads threads. Throws std::runtime_error on failure
+template<class Counts>
+Word_list<Counts> read_dictionary(const std::string & dictionary_filename,
+                                  const std::uint32_t flags,
+                                  const std::size_t num_threads,
+                                  const bool with_trie)
+{
+    return make_word_list<Counts>(read_words(dictionary_filename, flags, num_threads), flags, dictionary_filename, with_trie);
+}
+
+// count the letters in text, ignoring apostrophes. Throws std::runtime_error
+// if it has anything else that isn't a letter of alphabet, or too many of one
+// letter
+template<class Counts>
+Counts parse_text(const std::vector<std::string> & text, const Alphabet & alphabet)
+{
+    std::string letters;
+    for(auto & word: text)
+    {
+        if(alphabet.english())
+        {
+            for(auto c: word)
+            {
+                if(c == '\'')
+                    continue;
+
+                c = std::toupper(c);
+                if(c < 'A' || c > 'Z')
+                    throw std::runtime_error(std::string("Illegal character in input: '") + c + "'");
+                letters += c;
+            }
+            continue;
+        }
+
+        for(std::size_t i = 0; i < word.size();)
+        {
+            const auto c = upper_case(decode_utf8(word.data(), word.size(), i));
+            if(c == invalid_code_point)
+                throw std::runtime_error("Input is not valid UTF-8");
+            if(is_apostrophe(c))
+                continue;
+
+            std::string letter;
+            append_utf8(c, letter);
+            if(!is_letter(c))
+                throw std::runtime_error("Illegal character in input: '" + letter + "'");
+            if(alphabet.slot(c) < 0)
+                throw std::runtime_error("No word in the dictionary has the letter '" + letter + "'");
+            letters += letter;
+        }
+    }
+
+    Counts ltrs;
+    if(!count_letters(letters.data(), letters.size(), alphabet, ltrs))
+        throw std::runtime_error("Too many of one letter in input (max " + std::to_string(+std::numeric_limits<std::uint8_t>::max()) + ")");
+
+    return ltrs;
+}
 
-void find_words(const std::array<std::size_t, ALPHABET_LEN> & ltrs,
-                const std::vector<std::string> & word_list,
-                const std::vector<std::string> & prefix,
-                std::unordered_set<std::string> & seen_groups,
-                const bool show_partial,
-                const bool permutations,
-                const bool use_apostrophe,
-                const std::size_t start_ltr_count)
+// Record in stats how much of dictionary was pruned to make view
+template<class Counts>
+void count_pruned(const Word_list<Counts> & dictionary, const Word_list<Counts> & view, Search_stats & stats)
 {
-    if(std::accumulate(ltrs.begin(), ltrs.end(), 0) == 0)
-        return;
+    stats.classes_kept = view.num_classes();
+    stats.classes_removed = dictionary.num_classes() - view.num_classes();
+    stats.words_kept = view.num_words();
+    stats.words_removed = dictionary.num_words() - view.num_words();
+}
+
+// Search for anagrams of ltrs, writing them to fd, then the number of them if
+// counting. The search uses only the dictionary's words that fit in ltrs,
+// pruned into worker.view. worker is reset and used for the search, so a
+// caller making many searches can reuse its memory. Returns the search's
+// statistics. With worker.checkpoint set, the search is saved there as it
+// goes, or resumed from there, and the output is cut back to match. Throws
+// std::runtime_error if that fails
+template<class Counts>
+Search_stats run_search(const Counts & ltrs,
+                        const Word_list<Counts> & full_dictionary,
+                        const Search_options & options,
+                        const std::size_t num_threads,
+                        const bool ordered,
+                        const int fd,
+                        Worker<Counts> & worker)
+{
+    const auto allocations = allocation_count.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    Search_shared shared(options);
+    worker.reset();
+    worker.shared = &shared;
+    worker.fd = fd;
 
-    std::vector<std::array<std::size_t, ALPHABET_LEN>> new_ltrs;
-    std::vector<std::string> new_word_list;
-    std::vector<std::vector<std::string>> new_prefixes;
+    worker.view.prune(full_dictionary, ltrs, options.filter);
+    const auto & dictionary = worker.view;
 
-    for(auto & word: word_list)
+    if(num_threads > 1)
+    {
+        Work_pool<Counts> pool(dictionary, num_threads, ordered, options, shared, fd);
+        pool.run(ltrs);
+        worker.stats = pool.stats();
+    }
+    else
     {
-        std::array<std::size_t, ALPHABET_LEN> word_ltrs(ltrs);
-        bool use_word = true;
+        if(options.memo_bytes)
+            worker.memo.reset(new Memo_cache<Counts>(options.memo_bytes));
 
-        for(auto & c: word)
+        if(!worker.checkpoint)
+            search_dictionary(ltrs, dictionary, options, worker);
+        else
         {
-            if(use_apostrophe && c == '\'')
-                continue;
-
-            if(word_ltrs[c - 'A'] == 0)
+            worker.checkpoint_key = search_key(ltrs, dictionary, options);
+            worker.checkpoint_countdown = checkpoint_check_nodes;
+            worker.next_checkpoint = std::chrono::steady_clock::now() + worker.checkpoint->interval;
+            if(worker.checkpoint->resume)
             {
-                use_word = false;
-                break;
+                load_checkpoint(dictionary, options, worker);
+                run_stack(0, dictionary, options, worker);
+                if(options.num_shards > 1)
+                    search_shard(ltrs, worker.shard_part + 1, dictionary, options, worker);
             }
+            else
+                search_dictionary(ltrs, dictionary, options, worker);
+
+            // so resuming a finished search prints nothing more
+            save_checkpoint(worker);
+        }
+    }
+
+    if(shared.best)
+        output_best(*shared.best, dictionary, options, worker);
+    flush_output(worker);
+    if(options.count_only)
+    {
+        Stats_timer timer(worker.stats.output_seconds);
+        write_output(fd, std::to_string(worker.stats.full_anagrams + (options.show_partial ? worker.stats.partial_anagrams : 0)) + "\n");
+    }
+
+    auto stats = worker.stats;
+    count_pruned(full_dictionary, dictionary, stats);
+    stats.allocations = allocation_count.load() - allocations;
+    stats.search_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    worker.shared = nullptr;
+
+    return stats;
+}
+
+// A line of a --batch file
+template<class Counts>
+struct Batch_input
+{
+    std::size_t id; // line number
+    Counts ltrs;
+};
+
+// read --batch inputs from a file, one per line, skipping blank lines.
+// Throws std::runtime_error on failure, or if any line isn't valid input
+template<class Counts>
+std::vector<Batch_input<Counts>> read_batch(const std::string & filename, const Alphabet & alphabet)
+{
+    std::ifstream file(filename);
+    if(!file)
+        throw std::runtime_error("Error opening " + filename + ": " + std::strerror(errno));
+
+    std::vector<Batch_input<Counts>> inputs;
+    std::string line;
+    for(std::size_t id = 1; std::getline(file, line); ++id)
+    {
+        std::istringstream words_stream(line);
+        std::vector<std::string> words{std::istream_iterator<std::string>(words_stream), std::istream_iterator<std::string>()};
+        if(words.empty())
+            continue;
+
+        try
+        {
+            inputs.push_back(Batch_input<Counts>{id, parse_text<Counts>(words, alphabet)});
+        }
+        catch(std::runtime_error & e)
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(id) + ": " + e.what());
+        }
+    }
+
+    if(file.bad())
+        throw std::runtime_error("Error reading " + filename + ": " + std::strerror(errno));
+
+    return inputs;
+}
+
+// read words from a file, one or more per line, and mark those in dictionary,
+// for --exclude-file. Words that aren't in dictionary are skipped. Throws
+// std::runtime_error on failure
+template<class Counts>
+std::shared_ptr<const std::vector<bool>> read_excluded(const std::string & filename, const Word_list<Counts> & dictionary)
+{
+    std::ifstream file(filename);
+    if(!file)
+        throw std::runtime_error("Error opening " + filename + ": " + std::strerror(errno));
+
+    auto excluded = std::make_shared<std::vector<bool>>(dictionary.num_words());
+    for(std::string word; file>>word;)
+    {
+        const auto w = dictionary.find_word(upper_case_word(word));
+        if(w < dictionary.num_words())
+            (*excluded)[w] = true;
+    }
+
+    if(file.bad())
+        throw std::runtime_error("Error reading " + filename + ": " + std::strerror(errno));
+
+    return excluded;
+}
+
+// Search for anagrams of each input, writing them to fd, each line starting
+// with its input's id and a tab. The inputs are shared between num_threads
+// threads, each searching one input at a time. When counting, writes each
+// input's id and count instead. Returns the statistics of every search
+template<class Counts>
+Search_stats run_batch(const std::vector<Batch_input<Counts>> & inputs,
+                       const Word_list<Counts> & full_dictionary,
+                       const Search_options & options,
+                       const std::size_t num_threads,
+                       const int fd)
+{
+    // prune the dictionary once for all the inputs: any class that fits one
+    // of them fits the largest count of each letter among them
+    Counts most_ltrs{};
+    for(auto & input: inputs)
+    {
+        for(std::size_t i = 0; i < Counts::slots; ++i)
+            most_ltrs[i] = std::max(most_ltrs[i], input.ltrs[i]);
+    }
+
+    Word_list<Counts> dictionary;
+    dictionary.prune(full_dictionary, most_ltrs, options.filter);
+
+    std::vector<std::uint32_t> root_candidates(dictionary.num_classes());
+    std::iota(root_candidates.begin(), root_candidates.end(), 0);
+    order_candidates(root_candidates, dictionary, options);
+
+    const auto allocations = allocation_count.load();
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<std::size_t> next_input{0};
+    std::mutex mutex; // guards fd and stats
+    Search_stats stats;
+
+    auto work = [&]()
+    {
+        Worker<Counts> worker;
+        worker.fd = fd;
+        worker.fd_mutex = &mutex;
+        // every node's candidates are the same whichever input it's under,
+        // so one cache serves them all
+        if(options.memo_bytes)
+            worker.memo.reset(new Memo_cache<Counts>(options.memo_bytes / num_threads));
+
+        for(std::size_t i; (i = next_input++) < inputs.size();)
+        {
+            const auto & input = inputs[i];
+            worker.tag = std::to_string(input.id) + "\t";
+            worker.candidates = root_candidates;
+            worker.prefix.clear();
+
+            const auto full_before = worker.stats.full_anagrams;
+            const auto partial_before = worker.stats.partial_anagrams;
+            Search_shared shared(options);
+            worker.shared = &shared;
+            search_node(input.ltrs, 0, root_candidates.size(), dictionary, options, worker);
+            if(shared.best)
+                output_best(*shared.best, dictionary, options, worker);
 
-            --word_ltrs[c - 'A'];
+            if(options.count_only)
+            {
+                auto found = worker.stats.full_anagrams - full_before;
+                if(options.show_partial)
+                    found += worker.stats.partial_anagrams - partial_before;
+                worker.buffer += worker.tag + std::to_string(found) + "\n";
+                if(worker.buffer.size() >= Worker<Counts>::flush_size)
+                    flush_output(worker);
+            }
         }
-        if(use_word)
+
+        flush_output(worker);
+        std::lock_guard<std::mutex> lock(mutex);
+        stats += worker.stats;
+    };
+
+    std::vector<std::thread> threads;
+    for(std::size_t i = 1; i < std::min(num_threads, inputs.size()); ++i)
+        threads.emplace_back(work);
+    work();
+
+    for(auto & t: threads)
+        t.join();
+
+    count_pruned(full_dictionary, dictionary, stats);
+    stats.allocations = allocation_count.load() - allocations;
+    stats.search_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Reads lines from a file descriptor
+class Line_reader
+{
+public:
+    explicit Line_reader(const int fd): fd_(fd) {}
+
+    // read the next line, without its newline. Returns false at the end of
+    // the input, or on error
+    bool getline(std::string & line)
+    {
+        while(true)
         {
-            auto new_prefix = prefix;
-            new_prefix.emplace_back(word);
+            auto end = buffer_.find('\n', pos_);
+            if(end != std::string::npos)
+            {
+                line.assign(buffer_, pos_, end - pos_);
+                pos_ = end + 1;
+                return true;
+            }
 
-            if(!permutations)
-                std::sort(new_prefix.begin(), new_prefix.end());
+            buffer_.erase(0, pos_);
+            pos_ = 0;
 
-            std::size_t ltr_count = 0;
-            std::string anagram;
-            for(const auto & prefix_word: new_prefix)
+            char chunk[4096];
+            auto got = ::read(fd_, chunk, sizeof(chunk));
+            if(got < 0 && errno == EINTR)
+                continue;
+            if(got <= 0)
             {
-                if(use_apostrophe)
-                {
-                    for(auto & c: prefix_word)
-                    {
-                        if(c != '\'')
-                            ++ltr_count;
-                    }
-                }
-                else
-                    ltr_count += prefix_word.size();
+                // a last line with no newline
+                if(buffer_.empty())
+                    return false;
+                line.swap(buffer_);
+                buffer_.clear();
+                return true;
+            }
+            buffer_.append(chunk, got);
+        }
+    }
+
+private:
+    const int fd_;
+    std::string buffer_;
+    std::size_t pos_ = 0;
+};
+
+// Settings for --serve, shared by every query
+struct Server_settings
+{
+    Search_options options; // defaults for each query
+    std::size_t num_threads = 1;
+    bool ordered = false;
+};
+
+// Answer queries read from in_fd, one per line, writing the results to
+// out_fd. A query is any of -p, -r, -c and -l LIMIT, then its text. Each query's
+// results are followed by an empty line, and errors are reported on a line
+// starting with "error: "
+template<class Counts>
+void serve(const int in_fd, const int out_fd, const Word_list<Counts> & dictionary, const Server_settings & settings)
+{
+    po::options_description query_desc;
+    query_desc.add_options()
+        ("show-partial,p", "")
+        ("permutations,r", "")
+        ("count,c", "")
+        ("limit,l", po::value<std::uint64_t>())
+        ("text", po::value<std::vector<std::string>>());
+
+    po::positional_options_description query_pd;
+    query_pd.add("text", -1);
+
+    Line_reader reader(in_fd);
+    std::string line;
+    Worker<Counts> worker; // reused by every query
+    while(reader.getline(line))
+    {
+        try
+        {
+            po::variables_map vm;
+            po::store(po::command_line_parser(po::split_unix(line)).options(query_desc).positional(query_pd).run(), vm);
+            po::notify(vm);
 
-                if(!anagram.empty())
-                    anagram += " ";
-                anagram += prefix_word;
+            auto options = settings.options;
+            options.show_partial |= vm.count("show-partial") > 0;
+            options.permutations |= vm.count("permutations") > 0;
+            options.count_only |= vm.count("count") > 0;
+            if(vm.count("limit"))
+            {
+                options.limit = vm["limit"].as<std::uint64_t>();
+                if(!options.limit)
+                    throw std::runtime_error("-l must be at least 1");
+                if(settings.ordered && settings.num_threads > 1)
+                    throw std::runtime_error("-l can't be used with --ordered and more than one thread");
             }
+            if(options.best && (options.show_partial || options.count_only || options.limit))
+                throw std::runtime_error("--best can't be used with --show-partial, --count or --limit");
+
+            auto ltrs = parse_text<Counts>(vm.count("text") ? vm["text"].as<std::vector<std::string>>() : std::vector<std::string>(),
+                                           dictionary.alphabet());
+            run_search(ltrs, dictionary, options, settings.num_threads, settings.ordered, out_fd, worker);
+        }
+        catch(std::exception & e)
+        {
+            write_output(out_fd, std::string("error: ") + e.what() + "\n");
+        }
+
+        write_output(out_fd, "\n");
+    }
+}
+
+// Listen for connections on a Unix domain socket at path, serving each one's
+// queries on its own thread. Only returns by throwing std::runtime_error
+template<class Counts>
+void serve_socket(const std::string & path, const Word_list<Counts> & dictionary, const Server_settings & settings)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Socket path too long: " + path);
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+        throw std::runtime_error(std::string("Error creating socket: ") + std::strerror(errno));
+
+    // replace a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if(::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        ::unlink(path.c_str());
+
+    if(::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(listen_fd, SOMAXCONN) < 0)
+    {
+        auto error = errno;
+        ::close(listen_fd);
+        throw std::runtime_error("Error listening on " + path + ": " + std::strerror(error));
+    }
 
-            if(permutations || !seen_groups.count(anagram))
+    // a client hanging up mid-query shouldn't kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // connections' threads use dictionary and settings, so they're joined
+    // before returning. Each thread closes its socket as soon as its queries
+    // are answered, so the client sees EOF; finished threads are joined as
+    // new connections are accepted
+    struct Connection_state
+    {
+        int fd;
+        bool closed = false;
+        std::mutex mutex; // guards closed, so fd isn't used after it's closed
+    };
+    struct Connection
+    {
+        std::shared_ptr<Connection_state> state;
+        std::thread thread;
+    };
+    std::list<Connection> connections;
+    auto join_finished = [&connections]()
+    {
+        for(auto c = connections.begin(); c != connections.end();)
+        {
             {
-                if(show_partial)
-                {
-                    if(ltr_count == start_ltr_count)
-                        std::cout<<"* "<<anagram<<std::endl;
-                    else
-                        std::cout<<"  "<<anagram<<std::endl;
-                }
-                else
+                std::lock_guard<std::mutex> lock(c->state->mutex);
+                if(!c->state->closed)
                 {
-                    if(ltr_count == start_ltr_count)
-                        std::cout<<anagram<<std::endl;
+                    ++c;
+                    continue;
                 }
+            }
+            c->thread.join();
+            c = connections.erase(c);
+        }
+    };
 
-                new_ltrs.emplace_back(word_ltrs);
-                new_word_list.emplace_back(word);
-                new_prefixes.emplace_back(new_prefix);
+    while(true)
+    {
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // out of file descriptors: wait for connections to close
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                join_finished();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            auto error = errno;
+            ::close(listen_fd);
 
-                if(!permutations)
-                    seen_groups.emplace(anagram);
+            // end every connection's queries, as if its client had stopped
+            // sending them, and wait for it to finish
+            for(auto & c: connections)
+            {
+                std::lock_guard<std::mutex> lock(c.state->mutex);
+                if(!c.state->closed)
+                    ::shutdown(c.state->fd, SHUT_RD);
             }
+            for(auto & c: connections)
+                c.thread.join();
+            throw std::runtime_error("Error accepting connection on " + path + ": " + std::strerror(error));
         }
-    }
 
-    for(std::size_t i = 0; i < new_ltrs.size(); ++i)
-        find_words(new_ltrs[i],
-                   new_word_list,
-                   new_prefixes[i],
-                   seen_groups,
-                   show_partial,
-                   permutations,
-                   use_apostrophe,
-                   start_ltr_count);
+        join_finished();
+        auto state = std::make_shared<Connection_state>();
+        state->fd = fd;
+        connections.push_back(Connection{state, std::thread([state, &dictionary, &settings]()
+        {
+            serve(state->fd, state->fd, dictionary, settings);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            ::close(state->fd);
+            state->closed = true;
+        })});
+    }
 }
 
 std::string generate_usage(char * argv[],
@@ -208,6 +4299,145 @@ std::string generate_usage(char * argv[],
     return usage;
 }
 
+// anagram_bench includes this file for its functions, and has its own main
+#ifndef ANAGRAM_NO_MAIN
+// The rest of main, once the alphabet has decided the size of Letter_counts.
+// words is the dictionary already read, unless it's to be loaded from an index
+template<class Counts>
+int run(const po::variables_map & vm,
+        Search_options options,
+        const std::uint32_t dictionary_flags,
+        const Dictionary_words & words,
+        const std::size_t num_threads,
+        const std::chrono::steady_clock::time_point load_start)
+{
+    bool ordered = vm.count("ordered") > 0;
+    bool show_stats = vm.count("stats") > 0;
+
+    Counts ltrs;
+    std::vector<Batch_input<Counts>> batch;
+    Word_list<Counts> dictionary;
+    try
+    {
+        if(vm.count("index"))
+        {
+            auto index_filename = vm["index"].as<std::string>();
+            dictionary = Word_list<Counts>::map_index(index_filename);
+            if(dictionary.flags() != dictionary_flags)
+            {
+                std::cerr<<index_filename<<" was built with different --no-apostrophe / --small-words / --unicode options"<<std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            // the trie only pays for itself over many prunes: an index's
+            // searches, or a server's
+            dictionary = make_word_list<Counts>(words, dictionary_flags, vm["dictionary"].as<std::string>(),
+                                                vm.count("build-index") || vm.count("serve"));
+        }
+
+        if(vm.count("build-index"))
+        {
+            dictionary.write_index(vm["build-index"].as<std::string>());
+            return EXIT_SUCCESS;
+        }
+
+        if(vm.count("exclude-file"))
+            options.filter.excluded = read_excluded(vm["exclude-file"].as<std::string>(), dictionary);
+
+        if(vm.count("serve"))
+        {
+            Server_settings settings;
+            settings.options = options;
+            settings.num_threads = num_threads;
+            settings.ordered = ordered;
+
+            if(vm.count("socket"))
+                serve_socket(vm["socket"].as<std::string>(), dictionary, settings);
+            else
+                serve(STDIN_FILENO, STDOUT_FILENO, dictionary, settings);
+            return EXIT_SUCCESS;
+        }
+
+        ltrs = parse_text<Counts>(vm.count("text") ? vm["text"].as<std::vector<std::string>>() : std::vector<std::string>(),
+                                  dictionary.alphabet());
+        if(!options.include.empty())
+        {
+            // included words must be ones the search could have used
+            for(auto & word: options.include)
+            {
+                const auto w = dictionary.find_word(word);
+                if(w == dictionary.num_words())
+                    throw std::runtime_error("--include word " + word + " isn't in the word list");
+                if(options.filter.excludes(w))
+                    throw std::runtime_error("--include word " + word + " is in the --exclude-file");
+                if(!options.filter.keeps_length(parse_text<Counts>({word}, dictionary.alphabet()).total()))
+                    throw std::runtime_error("--include word " + word + " is outside --min-word-len and --max-word-len");
+            }
+
+            // the search only looks for the rest of the letters
+            auto include_ltrs = parse_text<Counts>(options.include, dictionary.alphabet());
+            if(!ltrs.contains(include_ltrs))
+                throw std::runtime_error("TEXT doesn't have the letters of every --include word");
+            Counts rest;
+            ltrs.subtract_unchecked(include_ltrs, rest);
+            ltrs = rest;
+        }
+        if(vm.count("batch"))
+            batch = read_batch<Counts>(vm["batch"].as<std::string>(), dictionary.alphabet());
+    }
+    catch(std::runtime_error & e)
+    {
+        std::cerr<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+
+    if(vm.count("estimate"))
+    {
+        auto estimate = estimate_search(ltrs, dictionary, options, vm["estimate"].as<std::size_t>());
+        std::cout<<"anagrams: "<<std::llround(estimate.anagrams)<<" +/- "<<std::llround(estimate.anagrams_error)<<"\n"
+                 <<"classes tested: "<<std::llround(estimate.tested)<<"\n"
+                 <<"search time: "<<estimate.seconds<<" s"<<std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    Worker<Counts> worker;
+    Checkpoint_settings checkpoint;
+    if(vm.count("checkpoint"))
+    {
+        checkpoint.path = vm["checkpoint"].as<std::string>();
+        checkpoint.interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(vm["checkpoint-interval"].as<double>()));
+        checkpoint.resume = vm.count("resume") > 0;
+        worker.checkpoint = &checkpoint;
+
+        // output appended to a file starts at its end, which checkpoints record
+        if(!checkpoint.resume)
+            ::lseek(STDOUT_FILENO, 0, SEEK_END);
+    }
+
+    Search_stats stats;
+    try
+    {
+        stats = vm.count("batch")
+            ? run_batch(batch, dictionary, options, num_threads, STDOUT_FILENO)
+            : run_search(ltrs, dictionary, options, num_threads, ordered, STDOUT_FILENO, worker);
+    }
+    catch(std::runtime_error & e)
+    {
+        std::cerr<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(show_stats)
+        print_stats(std::cerr, stats, load_time.count());
+
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char * argv[])
 {
     const std::string prog_desc = "Anagram generator";
@@ -219,14 +4449,61 @@ int main(int argc, char * argv[])
     optional_desc.add_options()
         ("help,h", "Show this help message and exit")
         ("show-partial,p", "Show partial anagrams. Full anagrams will be preceded by an '*'")
-        ("permutations,r", "Generate each permutation instead of each combination. Much slower, but uses much less memory")
+        ("permutations,r", "Generate each permutation instead of each combination")
         ("no-apostrophe,n", "Don't generate words with apostrophes")
         ("small-words,s", "Restrict small (<= 2 letters) words to a predefined set")
+        ("unicode,u", "Read DICTIONARY and TEXT as UTF-8, with every letter in DICTIONARY as the alphabet, instead of only A to Z")
+        ("threads,t", po::value<std::size_t>()->default_value(1)->value_name("THREADS"),
+            "Number of threads to load DICTIONARY and search with. 0 to use one per CPU core")
+        ("ordered,o", "When using multiple threads, print results in the same order as a single thread would")
+        ("prime-filter", "Also reject words whose letters' prime product doesn't divide the remaining letters' product")
+        ("memo", po::value<std::size_t>()->value_name("MEGABYTES"),
+            "Remember what was found for each set of letters left, so it's only searched once. Uses up to MEGABYTES of memory, split between threads")
+        ("count,c", "Print the number of anagrams instead of the anagrams themselves")
+        ("limit,l", po::value<std::uint64_t>()->value_name("LIMIT"),
+            "Stop after finding LIMIT full anagrams")
+        ("best", po::value<std::uint64_t>()->value_name("N"),
+            "Print only the best N full anagrams, as ranked by --score, best first")
+        ("score", po::value<std::string>()->default_value("fewest-words")->value_name("SCORE"),
+            "How --best ranks anagrams: fewest-words or longest-word")
+        ("estimate", po::value<std::size_t>()->value_name("PROBES"),
+            "Estimate the number of anagrams and the search time from PROBES random paths through the search, without searching")
+        ("checkpoint", po::value<std::string>()->value_name("FILE"),
+            "Save the search's progress to FILE as it goes, so it can be carried on with --resume if it's stopped. "
+            "Output must go to a file, unless counting")
+        ("checkpoint-interval", po::value<double>()->default_value(60)->value_name("SECONDS"),
+            "Time between --checkpoint saves")
+        ("resume", "Carry on the search saved in the --checkpoint FILE, appending to the output of the search that saved it")
+        ("include", po::value<std::vector<std::string>>()->value_name("WORD"),
+            "Only find anagrams with WORD in them. WORD must be in the word list, and not left out by the other word filters. "
+            "Can be given more than once")
+        ("max-words", po::value<std::size_t>()->value_name("N"),
+            "Only find anagrams of at most N words, including --include words")
+        ("min-word-len", po::value<std::size_t>()->value_name("LETTERS"),
+            "Only use words of at least LETTERS letters")
+        ("max-word-len", po::value<std::size_t>()->value_name("LETTERS"),
+            "Only use words of at most LETTERS letters")
+        ("exclude-file", po::value<std::string>()->value_name("FILE"),
+            "Don't use the words listed in FILE")
+        ("shard", po::value<std::string>()->value_name("I/N"),
+            "Search only the I-th of N parts of the search, from 1 to N. The N parts' output, one after another, is the whole search's")
+        ("stats", "Print search statistics to stderr, as JSON")
         ("dictionary,d", po::value<std::string>()->default_value("/usr/share/dict/words")->value_name("DICTIONARY"),
-            "Dictionary file");
+            "Dictionary file")
+        ("index,i", po::value<std::string>()->value_name("INDEX"),
+            "Load the dictionary from an index built by --build-index, instead of from DICTIONARY")
+        ("build-index", po::value<std::string>()->value_name("INDEX"),
+            "Build an index of DICTIONARY for fast loading with --index, and exit. TEXT is not needed")
+        ("batch", po::value<std::string>()->value_name("FILE"),
+            "Instead of searching for TEXT, search for each line of FILE, spread over THREADS threads. "
+            "Each result starts with its line number and a tab")
+        ("serve", "Instead of searching for TEXT, keep the dictionary loaded and answer queries from stdin, one per line. "
+            "A query is any of -p, -r, -c and -l LIMIT, then its text, and its results end with an empty line")
+        ("socket", po::value<std::string>()->value_name("PATH"),
+            "With --serve, answer queries from connections to a Unix domain socket at PATH instead of from stdin");
 
     positional_desc.add_options()
-        ("text", po::value<std::vector<std::string>>()->value_name("TEXT")->required(),
+        ("text", po::value<std::vector<std::string>>()->value_name("TEXT"),
             "Text to generate anagrams for");
 
     pd.add("text", -1);
@@ -248,6 +4525,9 @@ int main(int argc, char * argv[])
         }
 
         po::notify(vm);
+
+        if(!vm.count("text") && !vm.count("build-index") && !vm.count("batch") && !vm.count("serve"))
+            throw po::required_option("--text");
     }
     catch(po::error & e)
     {
@@ -256,96 +4536,187 @@ int main(int argc, char * argv[])
         return EXIT_FAILURE;
     }
 
-    bool show_partial = vm.count("show-partial") > 0;
-    bool permutations = vm.count("permutations") > 0;
-    bool use_apostrophe = vm.count("no-apostrophe") == 0;
-    bool restrict_small_words = vm.count("small-words") > 0;
-    std::string dictionary_filename = vm["dictionary"].as<std::string>();
+    Search_options options;
+    options.show_partial = vm.count("show-partial") > 0;
+    options.permutations = vm.count("permutations") > 0;
+    options.prime_filter = vm.count("prime-filter") > 0;
+    options.count_only = vm.count("count") > 0;
+    if(vm.count("limit"))
+        options.limit = vm["limit"].as<std::uint64_t>();
+    if(vm.count("best"))
+        options.best = vm["best"].as<std::uint64_t>();
 
-    // get letter counts
-    std::array<std::size_t, ALPHABET_LEN> ltrs;
-    std::fill(ltrs.begin(), ltrs.end(), 0);
+    auto score = vm["score"].as<std::string>();
+    if(score == "fewest-words")
+        options.score = Search_options::FEWEST_WORDS;
+    else if(score == "longest-word")
+        options.score = Search_options::LONGEST_WORD;
+    else
+    {
+        std::cerr<<"Unknown score: "<<score<<" (expected fewest-words or longest-word)"<<std::endl;
+        return EXIT_FAILURE;
+    }
 
-    std::size_t start_ltr_count = 0;
-    for(auto & word: vm["text"].as<std::vector<std::string>>())
+    if((vm.count("limit") && !options.limit) || (vm.count("best") && !options.best))
+    {
+        std::cerr<<"--limit and --best must be at least 1"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.best && (options.show_partial || options.count_only || options.limit))
+    {
+        std::cerr<<"--best can't be used with --show-partial, --count or --limit"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(vm.count("estimate") && (options.best || options.limit || vm.count("batch") || vm.count("serve")))
     {
-        for(auto c: word)
+        std::cerr<<"--estimate can't be used with --best, --limit, --batch or --serve"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(vm.count("include"))
+    {
+        for(auto & word: vm["include"].as<std::vector<std::string>>())
         {
-            if(c == '\'')
-                continue;
-
-            c = std::toupper(c);
-            if(c < 'A' || c > 'Z')
+            if(word.empty())
             {
-                std::cerr<<"Illegal character in input: '"<<c<<"'"<<std::endl;
+                std::cerr<<"--include words can't be empty"<<std::endl;
                 return EXIT_FAILURE;
             }
-            ++ltrs[c - 'A'];
-            ++start_ltr_count;
+            options.include.push_back(upper_case_word(word));
+        }
+        std::sort(options.include.begin(), options.include.end());
+    }
+    if(vm.count("max-words"))
+    {
+        auto max_words = vm["max-words"].as<std::size_t>();
+        if(max_words < std::max<std::size_t>(options.include.size(), 1))
+        {
+            std::cerr<<"--max-words must be at least 1, and at least the number of --include words"<<std::endl;
+            return EXIT_FAILURE;
+        }
+        options.max_words = max_words - options.include.size();
+    }
+    if(vm.count("min-word-len"))
+        options.filter.min_letters = vm["min-word-len"].as<std::size_t>();
+    if(vm.count("max-word-len"))
+    {
+        options.filter.max_letters = vm["max-word-len"].as<std::size_t>();
+        if(!options.filter.max_letters)
+        {
+            std::cerr<<"--max-word-len must be at least 1"<<std::endl;
+            return EXIT_FAILURE;
         }
     }
 
-    // open dictionary file
-    std::ifstream dictionary_file(dictionary_filename);
-    try
+    if(!options.include.empty() && (options.best || vm.count("batch") || vm.count("serve")))
     {
-        dictionary_file.exceptions(std::ifstream::failbit | std::ifstream::badbit); // throw on error OR failure
+        std::cerr<<"--include can't be used with --best, --batch or --serve"<<std::endl;
+        return EXIT_FAILURE;
     }
-    catch(std::system_error & e)
+    if(vm.count("max-words") && vm.count("memo"))
     {
-        std::cerr<<"Error opening "<<dictionary_filename<<": "<<std::strerror(errno)<<std::endl;
+        std::cerr<<"--max-words can't be used with --memo"<<std::endl;
         return EXIT_FAILURE;
     }
 
-    std::vector<std::string> dictionary;
-    try
+    if(vm.count("shard"))
     {
-        std::unordered_set<std::string> dictionary_set;
-        dictionary_file.exceptions(std::ifstream::badbit); // only throw on error
+        auto shard = vm["shard"].as<std::string>();
+        std::istringstream in(shard);
+        char slash = 0;
+        if(!(in>>options.shard>>slash>>options.num_shards) || slash != '/' || !in.eof()
+                || options.shard < 1 || options.shard > options.num_shards)
+        {
+            std::cerr<<"Invalid shard: "<<shard<<" (expected I/N, with I from 1 to N)"<<std::endl;
+            return EXIT_FAILURE;
+        }
+        --options.shard;
 
-        std::string word;
-        while(std::getline(dictionary_file, word, '\n'))
+        if(options.best || options.limit || vm.count("batch") || vm.count("serve") || vm.count("estimate"))
         {
-            bool skip_word = false;
-            for(auto &c: word)
-            {
-                c = std::toupper(c);
-                if((!use_apostrophe || c != '\'') && (c < 'A' || c > 'Z'))
-                {
-                    skip_word = true;
-                    break;
-                }
-            }
+            std::cerr<<"--shard can't be used with --best, --limit, --batch, --serve or --estimate"<<std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if(vm.count("checkpoint"))
+    {
+        if(options.best || vm.count("batch") || vm.count("serve") || vm.count("estimate") || vm.count("build-index"))
+        {
+            std::cerr<<"--checkpoint can't be used with --best, --batch, --serve, --estimate or --build-index"<<std::endl;
+            return EXIT_FAILURE;
+        }
 
-            static const std::unordered_set<std::string> legal_small_words
-            {
-                "A", "I",
-                "AH", "AM", "AN", "AS", "AT", "BE", "BY", "DC", "DO",
-                "DR", "EX", "GO", "HA", "HE", "HI", "HO", "IF", "II",
-                "IN", "IS", "IT", "LA", "LO", "MA", "ME", "MR", "MS",
-                "MY", "NO", "OF", "OH", "OK", "ON", "OR", "OW", "OX",
-                "PA", "PI", "SO", "ST", "TO",
-                "UP", "US", "WE"
-            };
-
-            if(!skip_word && (!restrict_small_words || word.size() > 2 || legal_small_words.count(word)))
-            {
-                dictionary_set.emplace(word);
-            }
+        // resuming cuts the output back to where the checkpoint was saved
+        struct stat output_stat;
+        if(!options.count_only && (::fstat(STDOUT_FILENO, &output_stat) != 0 || !S_ISREG(output_stat.st_mode)))
+        {
+            std::cerr<<"--checkpoint needs output redirected to a file, unless used with --count"<<std::endl;
+            return EXIT_FAILURE;
         }
+    }
+    else if(vm.count("resume"))
+    {
+        std::cerr<<"--resume needs --checkpoint FILE"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(vm.count("memo"))
+    {
+        auto megabytes = vm["memo"].as<std::size_t>();
+        if(megabytes > std::numeric_limits<std::size_t>::max() >> 20)
+        {
+            std::cerr<<"--memo is too big: "<<megabytes<<" megabytes"<<std::endl;
+            return EXIT_FAILURE;
+        }
+        options.memo_bytes = megabytes << 20;
+    }
+    if(vm.count("stats") && !collect_stats)
+    {
+        std::cerr<<"--stats isn't available: built with ANAGRAM_NO_STATS"<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::uint32_t dictionary_flags = (vm.count("no-apostrophe") ? std::uint32_t(NO_APOSTROPHE) : 0)
+        | (vm.count("small-words") ? std::uint32_t(SMALL_WORDS) : 0)
+        | (vm.count("unicode") ? std::uint32_t(UNICODE_ALPHABET) : 0);
 
-        // put words into set to remove dupes. now put them into an array
-        dictionary.insert(dictionary.end(), dictionary_set.begin(), dictionary_set.end());
-        std::sort(dictionary.begin(), dictionary.end());
+    std::size_t num_threads = vm["threads"].as<std::size_t>();
+    if(num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if(vm.count("checkpoint") && num_threads > 1)
+    {
+        std::cerr<<"--checkpoint only works with --threads 1"<<std::endl;
+        return EXIT_FAILURE;
     }
-    catch(std::system_error & e)
+    // threads race for places among the limited results, so which ones win
+    // can't match a single-threaded search
+    if(vm.count("limit") && vm.count("ordered") && num_threads > 1 && !vm.count("batch"))
     {
-        std::cerr<<"Error reading "<<dictionary_filename<<": "<<std::strerror(errno)<<std::endl;
+        std::cerr<<"--limit can't be used with --ordered and more than one thread"<<std::endl;
         return EXIT_FAILURE;
     }
 
-    std::unordered_set<std::string> seen_groups;
-    find_words(ltrs, dictionary, std::vector<std::string>(), seen_groups, show_partial, permutations, use_apostrophe, start_ltr_count);
+    // the alphabet decides how big Letter_counts must be, so read the words
+    // first, or see what the index was built with
+    const auto load_start = std::chrono::steady_clock::now();
+    Dictionary_words words;
+    bool wide = false;
+    try
+    {
+        if(vm.count("index"))
+            wide = index_letter_counts_size(vm["index"].as<std::string>()) == sizeof(Wide_letter_counts);
+        else
+        {
+            words = read_words(vm["dictionary"].as<std::string>(), dictionary_flags, num_threads);
+            wide = words.alphabet.size() > Letter_counts::slots;
+        }
+    }
+    catch(std::runtime_error & e)
+    {
+        std::cerr<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    return wide
+        ? run<Wide_letter_counts>(vm, options, dictionary_flags, words, num_threads, load_start)
+        : run<Letter_counts>(vm, options, dictionary_flags, words, num_threads, load_start);
 }
+#endif
@@ -0,0 +1,259 @@
+// Benchmarks for the anagram generators, run against the word list and phrases
+// in this directory. Use --benchmark_format=json (or --benchmark_out=FILE
+// --benchmark_out_format=json) for machine-readable results
+//
+//     load/...                  reading the word list
+//     class_fits/PHRASE         testing every class against the phrase's letters
+//     prune[/trie]/PHRASE       pruning the word list to the phrase's letters
+//     combinations/PHRASE       a full single-threaded search
+//     permutations/PHRASE       the same, with -r
+//     process/PROGRAM/...       running anagram, or anagram_c if it was built,
+//                               on the same workloads, start to finish
+
+#define ANAGRAM_NO_MAIN
+#include "../anagram.cpp"
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <benchmark/benchmark.h>
+
+extern char ** environ;
+
+namespace
+{
+const std::string words_filename = ANAGRAM_BENCH_DIR "/words.txt";
+const std::string phrases_filename = ANAGRAM_BENCH_DIR "/phrases.txt";
+
+// permutations of longer phrases take minutes, so they're left out
+const std::size_t max_permutation_letters = 16;
+
+// read phrases, one per line, in order of increasing length
+std::vector<std::string> read_phrases()
+{
+    std::ifstream file(phrases_filename);
+    if(!file)
+        throw std::runtime_error("Error opening " + phrases_filename);
+
+    std::vector<std::string> phrases;
+    for(std::string line; std::getline(file, line);)
+    {
+        if(!line.empty())
+            phrases.push_back(line);
+    }
+    return phrases;
+}
+
+std::vector<std::string> split_words(const std::string & phrase)
+{
+    std::istringstream in(phrase);
+    return std::vector<std::string>(std::istream_iterator<std::string>(in), std::istream_iterator<std::string>());
+}
+
+// benchmark names can't have spaces
+std::string name_of(std::string phrase)
+{
+    std::replace(phrase.begin(), phrase.end(), ' ', '_');
+    return phrase;
+}
+
+const Word_list<Letter_counts> & dictionary(const bool with_trie = false)
+{
+    static const Word_list<Letter_counts> words = read_dictionary<Letter_counts>(words_filename, 0, 1, false);
+    static const Word_list<Letter_counts> trie_words = read_dictionary<Letter_counts>(words_filename, 0, 1, true);
+    return with_trie ? trie_words : words;
+}
+
+int null_fd()
+{
+    static const int fd = ::open("/dev/null", O_WRONLY);
+    return fd;
+}
+
+void bench_read_dictionary(benchmark::State & state)
+{
+    for(auto _: state)
+    {
+        auto words = read_dictionary<Letter_counts>(words_filename, 0, 1, false);
+        benchmark::DoNotOptimize(words.num_classes());
+    }
+}
+
+void bench_map_index(benchmark::State & state)
+{
+    char index_filename[] = "/tmp/anagram_bench_XXXXXX";
+    int fd = ::mkstemp(index_filename);
+    if(fd < 0)
+    {
+        state.SkipWithError("Can't create a temporary index file");
+        return;
+    }
+    ::close(fd);
+    dictionary(true).write_index(index_filename);
+
+    for(auto _: state)
+    {
+        auto words = Word_list<Letter_counts>::map_index(index_filename);
+        benchmark::DoNotOptimize(words.num_classes());
+    }
+
+    ::unlink(index_filename);
+}
+
+void bench_class_fits(benchmark::State & state, const Letter_counts ltrs, const bool prime_filter)
+{
+    auto & words = dictionary();
+    const auto mask = ltrs.mask();
+    const auto product = prime_filter ? letter_product(ltrs, words.alphabet()) : 0;
+    Search_stats stats;
+
+    for(auto _: state)
+    {
+        std::size_t fits = 0;
+        for(std::uint32_t class_i = 0; class_i < words.num_classes(); ++class_i)
+            fits += class_fits(ltrs, mask, product, class_i, words, stats);
+        benchmark::DoNotOptimize(fits);
+    }
+
+    state.SetItemsProcessed(state.iterations() * words.num_classes());
+}
+
+void bench_prune(benchmark::State & state, const Letter_counts ltrs, const bool with_trie)
+{
+    Word_list<Letter_counts> view;
+    for(auto _: state)
+    {
+        view.prune(dictionary(with_trie), ltrs);
+        benchmark::DoNotOptimize(view.num_classes());
+    }
+}
+
+void bench_search(benchmark::State & state, const Letter_counts ltrs, const bool permutations)
+{
+    Search_options options;
+    options.permutations = permutations;
+
+    Worker<Letter_counts> worker;
+    Search_stats stats;
+    for(auto _: state)
+        stats = run_search(ltrs, dictionary(), options, 1, false, null_fd(), worker);
+
+    state.counters["anagrams"] = stats.full_anagrams;
+    state.counters["classes_tested"] = stats.tested;
+}
+
+// run program with args, with its output discarded, and wait for it to finish
+void bench_process(benchmark::State & state, const std::string program, const std::vector<std::string> args)
+{
+    std::vector<std::string> argv_strings{program, "-d", words_filename};
+    argv_strings.insert(argv_strings.end(), args.begin(), args.end());
+    std::vector<char *> argv;
+    for(auto & arg: argv_strings)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    for(auto _: state)
+    {
+        pid_t pid;
+        int status;
+        if(posix_spawn(&pid, program.c_str(), &actions, nullptr, argv.data(), environ) != 0
+           || ::waitpid(pid, &status, 0) < 0
+           || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            state.SkipWithError(("Error running " + program).c_str());
+            break;
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+}
+
+void register_process(const std::string & name, const std::string & program, const std::vector<std::string> & phrases)
+{
+    for(auto & phrase: phrases)
+    {
+        benchmark::RegisterBenchmark(("process/" + name + "/combinations/" + name_of(phrase)).c_str(),
+                                     bench_process, program, split_words(phrase))
+            ->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+
+    for(auto & phrase: phrases)
+    {
+        if(parse_text<Letter_counts>(split_words(phrase), dictionary().alphabet()).total() > max_permutation_letters)
+            continue;
+
+        auto args = split_words(phrase);
+        args.insert(args.begin(), "-r");
+        benchmark::RegisterBenchmark(("process/" + name + "/permutations/" + name_of(phrase)).c_str(),
+                                     bench_process, program, args)
+            ->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+}
+}
+
+int main(int argc, char * argv[])
+{
+    std::vector<std::string> phrases;
+    try
+    {
+        phrases = read_phrases();
+        dictionary();
+    }
+    catch(const std::runtime_error & e)
+    {
+        std::cerr<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    benchmark::RegisterBenchmark("load/read_dictionary", bench_read_dictionary)->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("load/map_index", bench_map_index)->Unit(benchmark::kMicrosecond);
+
+    for(auto & phrase: phrases)
+    {
+        auto ltrs = parse_text<Letter_counts>(split_words(phrase), dictionary().alphabet());
+        benchmark::RegisterBenchmark(("class_fits/" + name_of(phrase)).c_str(), bench_class_fits, ltrs, false)
+            ->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("class_fits/prime_filter/" + name_of(phrase)).c_str(), bench_class_fits, ltrs, true)
+            ->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("prune/" + name_of(phrase)).c_str(), bench_prune, ltrs, false)
+            ->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("prune/trie/" + name_of(phrase)).c_str(), bench_prune, ltrs, true)
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    for(auto & phrase: phrases)
+    {
+        benchmark::RegisterBenchmark(("combinations/" + name_of(phrase)).c_str(), bench_search,
+                                     parse_text<Letter_counts>(split_words(phrase), dictionary().alphabet()), false)
+            ->Unit(benchmark::kMillisecond);
+    }
+
+    for(auto & phrase: phrases)
+    {
+        auto ltrs = parse_text<Letter_counts>(split_words(phrase), dictionary().alphabet());
+        if(ltrs.total() <= max_permutation_letters)
+        {
+            benchmark::RegisterBenchmark(("permutations/" + name_of(phrase)).c_str(), bench_search, ltrs, true)
+                ->Unit(benchmark::kMillisecond);
+        }
+    }
+
+#ifdef ANAGRAM_CPP_PATH
+    register_process("anagram", ANAGRAM_CPP_PATH, phrases);
+#endif
+#ifdef ANAGRAM_C_PATH
+    register_process("anagram_c", ANAGRAM_C_PATH, phrases);
+#endif
+
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv))
+        return EXIT_FAILURE;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return EXIT_SUCCESS;
+}